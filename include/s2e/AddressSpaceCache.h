@@ -11,6 +11,9 @@
 #define ADDRESS_SPACE_CACHE_H
 
 #include <inttypes.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <klee/AddressSpace.h>
 #include <klee/Memory.h>
 #include "MemoryCache.h"
@@ -18,21 +21,56 @@
 
 namespace s2e {
 
+static_assert(SE_RAM_OBJECT_BITS >= S2E_RAM_OBJECT_MIN_BITS && SE_RAM_OBJECT_BITS <= S2E_RAM_OBJECT_MAX_BITS,
+              "RAM objects must be between 1 KB and one target page (4 KB)");
+static_assert(S2E_RAM_SUBOBJECT_BITS < SE_RAM_OBJECT_BITS, "RAM subobjects must be smaller than RAM objects");
+
 class AddressSpaceCache {
 public:
-    typedef MemoryCachePool<klee::ObjectStateConstPtr, SE_RAM_OBJECT_BITS,
-                            12, // XXX: FIX THIS HARD-CODED STUFF!
+    typedef MemoryCachePool<klee::ObjectStateConstPtr, SE_RAM_OBJECT_BITS, S2E_MEMCACHE_PAGE_BITS,
                             S2E_MEMCACHE_SUPERPAGE_BITS>
         S2EMemoryCache;
 
 private:
+    /// Guest RAM whose untouched pages have no object yet
+    struct LazyRamRegion {
+        uintptr_t address;
+        uintptr_t size;
+    };
+
+    static std::vector<LazyRamRegion> s_lazyRamRegions;
+    static uint64_t s_lazyRamPages;
+
     klee::AddressSpace *m_addressSpace;
     mutable S2EMemoryCache m_memcache;
 
+    /// Number of lazy pages that got an object in this address space
+    uint64_t m_materializedPages;
+
+    /// Data of the pages whose object was dropped to save memory
+    std::unordered_map<uintptr_t, std::vector<uint8_t>> m_compressedPages;
+
+    /// Location of a compressed page in the swap file
+    struct SpilledPage {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::unordered_map<uintptr_t, SpilledPage> m_spilledPages;
+    std::string m_swapFile;
+
+    static klee::ObjectStatePtr allocatePage(uintptr_t page_addr);
+
+    bool loadSpilledPage(uintptr_t page_addr);
+
+    klee::ObjectStatePtr decompress(uintptr_t page_addr);
+
 public:
-    AddressSpaceCache(klee::AddressSpace *as) : m_addressSpace(as) {
+    AddressSpaceCache(klee::AddressSpace *as) : m_addressSpace(as), m_materializedPages(0) {
     }
 
+    ~AddressSpaceCache();
+
     void update(klee::AddressSpace *as) {
         m_addressSpace = as;
     }
@@ -46,8 +84,91 @@ public:
         m_memcache.registerPool(hostAddress, size);
     }
 
+    ///
+    /// \brief Declare a RAM region whose pages are created on first access
+    ///
+    /// The pages of the region that are not bound in the address space
+    /// are assumed to contain zeros. This applies to all the states.
+    ///
+    static void registerLazyRegion(uintptr_t hostAddress, uintptr_t size);
+
+    /// Record how many pages of the lazy regions had no data at registration
+    static void addLazyPages(uint64_t count);
+
+    ///
+    /// \brief Create the object of a lazy RAM page that was never accessed
+    ///
+    /// The page must not be bound in the address space yet. If the page
+    /// was compressed, this restores its object instead.
+    ///
+    /// \return nullptr if the page does not belong to a lazy region
+    ///
+    klee::ObjectStatePtr materialize(uintptr_t page_addr);
+
+    ///
+    /// \brief Replace the object of a page by a compressed copy of its data
+    ///
+    /// Only whole concrete pages that belong to this address space alone
+    /// are compressed, as dropping shared ones would not free anything.
+    /// The caller must make sure that nothing references the object anymore.
+    /// The page is restored as soon as it is looked up again.
+    ///
+    /// \return false if the page was left as is
+    ///
+    bool compress(uintptr_t page_addr);
+
+    /// Restore the objects of all the compressed pages
+    unsigned decompressAll();
+
+    bool hasCompressedPages() const {
+        return !m_compressedPages.empty() || !m_spilledPages.empty();
+    }
+
+    ///
+    /// \brief Move the compressed pages to the given file
+    ///
+    /// The pages are read back when they are looked up or decompressed.
+    /// The file is deleted once it is not needed anymore.
+    ///
+    /// \return false if the file could not be written, in which case
+    /// the pages stay in memory
+    ///
+    bool spill(const std::string &path);
+
+    /// Read the spilled pages back into memory, still compressed
+    void loadSpilledPages();
+
+    bool isSpilled() const {
+        return !m_swapFile.empty();
+    }
+
+    /// Size of the compressed pages that are still in memory
+    uint64_t getCompressedBytes() const;
+
     klee::ObjectStateConstPtr get(uintptr_t page_addr);
 
+    ///
+    /// \brief Same as get, but returns nullptr for lazy pages without an object
+    ///
+    /// Such pages are backed by the shared zero page until something
+    /// other than zeros is written to them.
+    ///
+    klee::ObjectStateConstPtr find(uintptr_t page_addr);
+
+    /// Object bound at the given address, without restoring or creating one
+    klee::ObjectStateConstPtr findBound(uintptr_t address) const {
+        return m_addressSpace->findObject(address);
+    }
+
+    static bool isLazyPage(uintptr_t page_addr);
+
+    /// Read-only page of zeros that backs untouched lazy pages
+    static const uint8_t *getZeroPage();
+
+    uint64_t getZeroBackedPageCount() const {
+        return s_lazyRamPages - m_materializedPages;
+    }
+
     klee::ObjectStatePtr getBaseObject(const klee::ObjectStatePtr &object);
 
     klee::ObjectStatePtr notifySplit(const klee::ObjectStateConstPtr &oldObject,
@@ -0,0 +1,67 @@
+///
+/// Copyright (C) 2016, Cyberhaven
+/// All rights reserved.
+///
+/// Licensed under the Cyberhaven Research License Agreement.
+///
+
+#ifndef S2E_CONCRETIZATION_CACHE_H
+#define S2E_CONCRETIZATION_CACHE_H
+
+#include <klee/Expr.h>
+#include <klee/util/ExprHashMap.h>
+#include <memory>
+
+namespace s2e {
+
+///
+/// \brief Memoizes the concrete values of expressions in a given state
+///
+/// The concrete value of an expression only depends on the concolic
+/// assignment of the state. Entries are therefore tagged with the version
+/// of the assignment they were computed for and the whole cache is dropped
+/// as soon as that version changes.
+///
+/// Forked states share the entries of their parent until one of them
+/// inserts a new value, at which point it gets its own copy. After a fork,
+/// only the state whose assignment was recomputed drops the shared entries.
+///
+class ConcretizationCache {
+public:
+    struct Entry {
+        klee::ref<klee::ConstantExpr> value;
+
+        /// Whether the state is constrained to this value
+        bool constrained;
+    };
+
+private:
+    typedef klee::ExprHashMap<Entry> Map;
+
+    std::shared_ptr<Map> m_entries;
+    uint64_t m_version;
+
+public:
+    ConcretizationCache() : m_entries(std::make_shared<Map>()), m_version(0) {
+    }
+
+    ///
+    /// \brief Look up the concrete value of an expression
+    ///
+    /// \param version the current version of the concolic assignment
+    /// \return nullptr if there is no valid entry for the expression
+    ///
+    const Entry *get(const klee::ref<klee::Expr> &expr, uint64_t version) const;
+
+    void put(const klee::ref<klee::Expr> &expr, uint64_t version, const klee::ref<klee::ConstantExpr> &value,
+             bool constrained);
+
+    void invalidate();
+
+    size_t size() const {
+        return m_entries->size();
+    }
+};
+}
+
+#endif
@@ -17,6 +17,7 @@
 #include <vector>
 
 #include <klee/Common.h>
+#include <s2e/MemoryGovernor.h>
 #include <s2e/s2e_libcpu_coreplugin.h>
 
 extern "C" {
@@ -389,6 +390,26 @@ public:
                  bool /* is child */>
         onProcessForkComplete;
 
+    ///
+    /// \brief Emitted when the memory governor changes the memory pressure level
+    ///
+    /// The level tells which measures are in effect (see \c MemoryPressureLevel).
+    ///
+    sigc::signal<void,
+                 MemoryPressureLevel /* new level */,
+                 uint64_t /* memory usage (PSS) in bytes */>
+        onMemoryPressure;
+
+    ///
+    /// \brief Emitted when the memory governor suspends an idle state, and when it resumes it
+    ///
+    /// The governor resumes the states it suspended once the memory pressure is gone.
+    ///
+    sigc::signal<void,
+                 S2EExecutionState*,
+                 bool /* suspended */>
+        onMemoryPressureStateSuspend;
+
     ///
     /// Signal that is emitted upon TLB miss.
     ///
@@ -10,12 +10,23 @@
 #define _S2E_MEMORY_CACHE_
 
 #include <inttypes.h>
+#include <algorithm>
 #include <iostream>
 #include <llvm/ADT/SmallVector.h>
+#include <memory>
 #include <vector>
 
 namespace s2e {
 
+///
+/// \brief Three-level radix tree that maps host addresses to objects
+///
+/// Copies of the cache share their tree nodes. A node is duplicated the first
+/// time a copy modifies it, which lets a forked state start with the warm
+/// cache of its parent. Entries that refer to objects which later become
+/// private to one of the states are invalidated by the copy-on-write
+/// notifications of that state.
+///
 template <class T, unsigned OBJSIZE_BITS, unsigned PAGESIZE_BITS, unsigned SUPERPAGESIZE_BITS> class MemoryCache {
 private:
     struct ThirdLevel {
@@ -27,29 +38,17 @@ private:
         }
     };
 
-    struct SecondLevel {
-        ThirdLevel *level2[1 << (SUPERPAGESIZE_BITS - PAGESIZE_BITS)];
-
-        SecondLevel() {
-            for (unsigned i = 0; i < (1 << (SUPERPAGESIZE_BITS - PAGESIZE_BITS)); ++i) {
-                level2[i] = nullptr;
-            }
-        }
+    typedef std::shared_ptr<ThirdLevel> ThirdLevelPtr;
 
-        ~SecondLevel() {
-            for (unsigned i = 0; i < (1 << (SUPERPAGESIZE_BITS - PAGESIZE_BITS)); ++i) {
-                if (level2[i]) {
-                    delete level2[i];
-                    level2[i] = nullptr;
-                }
-            }
-        }
+    struct SecondLevel {
+        ThirdLevelPtr level2[1 << (SUPERPAGESIZE_BITS - PAGESIZE_BITS)];
     };
 
-    SecondLevel **m_level1;
+    typedef std::shared_ptr<SecondLevel> SecondLevelPtr;
+
+    std::vector<SecondLevelPtr> m_level1;
     uint64_t m_hostAddrStart;
     uint64_t m_size;
-    unsigned m_pagecount;
 
     inline void resize() {
         uint64_t mask = (1 << SUPERPAGESIZE_BITS) - 1;
@@ -58,11 +57,17 @@ private:
             ++pagecount;
         }
 
-        m_pagecount = pagecount;
-        m_level1 = new SecondLevel *[pagecount];
-        for (unsigned i = 0; i < pagecount; ++i) {
-            m_level1[i] = nullptr;
+        m_level1.resize(pagecount);
+    }
+
+    /// Get a node that is not shared with other caches
+    template <typename N> static inline N *getPrivate(std::shared_ptr<N> &node) {
+        if (!node) {
+            node = std::make_shared<N>();
+        } else if (node.use_count() > 1) {
+            node = std::make_shared<N>(*node);
         }
+        return node.get();
     }
 
 public:
@@ -72,15 +77,8 @@ public:
         resize();
     }
 
-    // XXX: Clone an empty cache for now
-    MemoryCache(const MemoryCache &one) {
-        m_hostAddrStart = one.m_hostAddrStart;
-        m_size = one.m_size;
-        resize();
-    }
-
-    ~MemoryCache() {
-        flushCache();
+    MemoryCache(const MemoryCache &one)
+        : m_level1(one.m_level1), m_hostAddrStart(one.m_hostAddrStart), m_size(one.m_size) {
     }
 
     inline uint64_t getSize() const {
@@ -92,15 +90,12 @@ public:
     }
 
     inline void flushCache() {
-        for (unsigned i = 0; i < m_pagecount; ++i) {
-            if (m_level1[i]) {
-                delete m_level1[i];
-                m_level1[i] = nullptr;
-            }
+        for (auto &level2 : m_level1) {
+            level2 = nullptr;
         }
     }
 
-    inline bool contains(uint64_t hostAddress) {
+    inline bool contains(uint64_t hostAddress) const {
         return (hostAddress >= m_hostAddrStart) && (hostAddress < m_hostAddrStart + m_size);
     }
 
@@ -110,20 +105,15 @@ public:
         uint64_t level2 = (offset & ((1 << SUPERPAGESIZE_BITS) - 1)) >> PAGESIZE_BITS;
         uint64_t level3 = (offset >> OBJSIZE_BITS) & ((1 << (PAGESIZE_BITS - OBJSIZE_BITS)) - 1);
 
-        SecondLevel *ptrLevel2;
-        if (!(ptrLevel2 = m_level1[level1])) {
-            ptrLevel2 = new SecondLevel();
-            m_level1[level1] = ptrLevel2;
-        }
+        assert(level3 < (1 << (PAGESIZE_BITS - OBJSIZE_BITS)));
 
-        ThirdLevel *ptrLevel3;
-        if (!(ptrLevel3 = ptrLevel2->level2[level2])) {
-            ptrLevel3 = new ThirdLevel();
-            ptrLevel2->level2[level2] = ptrLevel3;
+        // Avoid unsharing nodes for no-op updates (e.g., invalidating missing entries)
+        if (get(hostAddress) == obj) {
+            return;
         }
 
-        assert(level3 < (1 << (PAGESIZE_BITS - OBJSIZE_BITS)));
-
+        SecondLevel *ptrLevel2 = getPrivate(m_level1[level1]);
+        ThirdLevel *ptrLevel3 = getPrivate(ptrLevel2->level2[level2]);
         ptrLevel3->level3[level3] = obj;
     }
 
@@ -134,30 +124,31 @@ public:
         uint64_t level3 = (offset >> OBJSIZE_BITS) & ((1 << (PAGESIZE_BITS - OBJSIZE_BITS)) - 1);
 
         SecondLevel *ptrLevel2;
-        if (!(ptrLevel2 = m_level1[level1])) {
+        if (!(ptrLevel2 = m_level1[level1].get())) {
             return T();
         }
 
         ThirdLevel *ptrLevel3;
-        if (!(ptrLevel3 = ptrLevel2->level2[level2])) {
+        if (!(ptrLevel3 = ptrLevel2->level2[level2].get())) {
             return T();
         }
 
         return ptrLevel3->level3[level3];
     }
 
-    inline T *getArray(uint64_t hostAddress) {
+    /// The returned array may be shared with other caches and must not be modified
+    inline const T *getArray(uint64_t hostAddress) {
         uint64_t offset = hostAddress - m_hostAddrStart;
         uint64_t level1 = offset >> SUPERPAGESIZE_BITS;
         uint64_t level2 = (offset & ((1 << SUPERPAGESIZE_BITS) - 1)) >> PAGESIZE_BITS;
 
         SecondLevel *ptrLevel2;
-        if (!(ptrLevel2 = m_level1[level1])) {
+        if (!(ptrLevel2 = m_level1[level1].get())) {
             return nullptr;
         }
 
         ThirdLevel *ptrLevel3;
-        if (!(ptrLevel3 = ptrLevel2->level2[level2])) {
+        if (!(ptrLevel3 = ptrLevel2->level2[level2].get())) {
             return nullptr;
         }
 
@@ -169,13 +160,38 @@ template <class T, unsigned OBJSIZE_BITS, unsigned PAGESIZE_BITS, unsigned SUPER
 private:
     typedef MemoryCache<T, OBJSIZE_BITS, PAGESIZE_BITS, SUPERPAGESIZE_BITS> MemoryCacheT;
     typedef llvm::SmallVector<MemoryCacheT *, 10> Caches;
+
+    // Sorted by start address, regions do not overlap
     Caches m_caches;
 
+    // Most accesses hit the same region (usually RAM) as the previous one
+    MemoryCacheT *m_lastHit;
+
+    MemoryCacheT *find(uint64_t hostAddress) {
+        if (m_lastHit && m_lastHit->contains(hostAddress)) {
+            return m_lastHit;
+        }
+
+        auto it = std::upper_bound(m_caches.begin(), m_caches.end(), hostAddress,
+                                   [](uint64_t address, const MemoryCacheT *mc) { return address < mc->getStart(); });
+        if (it == m_caches.begin()) {
+            return nullptr;
+        }
+
+        MemoryCacheT *mc = *(it - 1);
+        if (!mc->contains(hostAddress)) {
+            return nullptr;
+        }
+
+        m_lastHit = mc;
+        return mc;
+    }
+
 public:
-    MemoryCachePool() {
+    MemoryCachePool() : m_lastHit(nullptr) {
     }
 
-    MemoryCachePool(const MemoryCachePool &one) {
+    MemoryCachePool(const MemoryCachePool &one) : m_lastHit(nullptr) {
         for (unsigned i = 0; i < one.m_caches.size(); ++i) {
             m_caches.push_back(new MemoryCacheT(*one.m_caches[i]));
         }
@@ -196,56 +212,35 @@ public:
         }
     }
 
-    // We sort the cache be decreasing size.
-    // The idea is that most accesses fall in the RAM, so it will
-    // be found first in the list.
     void registerPool(uint64_t hostAddrStart, uint64_t size) {
         assert((hostAddrStart & ((1 << PAGESIZE_BITS) - 1)) == 0);
         MemoryCacheT *mc = new MemoryCacheT(hostAddrStart, size);
-        if (m_caches.size() == 0) {
-            m_caches.push_back(mc);
-            return;
-        }
 
-        // Locate the place to insert
-        typename Caches::iterator it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if (size > (*it)->getSize()) {
-                break;
-            }
-        }
+        auto it = std::upper_bound(m_caches.begin(), m_caches.end(), hostAddrStart,
+                                   [](uint64_t address, const MemoryCacheT *c) { return address < c->getStart(); });
+
+        assert(it == m_caches.begin() || !(*(it - 1))->contains(hostAddrStart));
+        assert(it == m_caches.end() || (*it)->getStart() >= hostAddrStart + size);
 
         m_caches.insert(it, mc);
+        m_lastHit = nullptr;
     }
 
     void put(uint64_t hostAddress, const T &obj) {
-        typename Caches::iterator it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if ((*it)->contains(hostAddress)) {
-                (*it)->put(hostAddress, obj);
-                return;
-            }
+        MemoryCacheT *mc = find(hostAddress);
+        if (mc) {
+            mc->put(hostAddress, obj);
         }
     }
 
-    T *getArray(uint64_t hostAddress) {
-        typename Caches::iterator it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if ((*it)->contains(hostAddress)) {
-                return (*it)->getArray(hostAddress);
-            }
-        }
-        return nullptr;
+    const T *getArray(uint64_t hostAddress) {
+        MemoryCacheT *mc = find(hostAddress);
+        return mc ? mc->getArray(hostAddress) : nullptr;
     }
 
     T get(uint64_t hostAddress) {
-        typename Caches::iterator it;
-        for (it = m_caches.begin(); it != m_caches.end(); ++it) {
-            if ((*it)->contains(hostAddress)) {
-                return (*it)->get(hostAddress);
-            }
-        }
-        return T();
+        MemoryCacheT *mc = find(hostAddress);
+        return mc ? mc->get(hostAddress) : T();
     }
 };
 }
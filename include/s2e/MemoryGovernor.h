@@ -0,0 +1,92 @@
+///
+/// Copyright (C) 2016, Cyberhaven
+/// All rights reserved.
+///
+/// Licensed under the Cyberhaven Research License Agreement.
+///
+
+#ifndef S2E_MEMORY_GOVERNOR_H
+#define S2E_MEMORY_GOVERNOR_H
+
+#include <inttypes.h>
+
+namespace s2e {
+
+///
+/// \brief How hard the engine tries to limit its memory usage
+///
+/// Each level includes the restrictions of the previous ones.
+///
+enum MemoryPressureLevel {
+    /// Memory usage is below the soft limit
+    MEMORY_PRESSURE_NONE,
+
+    /// Above the soft limit: load balancing does not spawn new processes
+    MEMORY_PRESSURE_NO_PROCESS_SPLIT,
+
+    /// Above the hard limit: states do not fork anymore
+    MEMORY_PRESSURE_NO_STATE_FORK,
+
+    /// Still above the hard limit: idle states are suspended and swapped out
+    MEMORY_PRESSURE_SWAP_STATES
+};
+
+///
+/// \brief Maps the memory usage of the process to a pressure level
+///
+/// The usage is sampled by the caller at regular intervals. The level
+/// escalates one step at a time while the usage stays above the hard limit,
+/// so that cheaper measures get a chance to work first. Between the two
+/// limits, states are not swapped out anymore but do not fork either.
+/// The level goes back to MEMORY_PRESSURE_NONE only once the usage drops
+/// below the soft limit.
+///
+class MemoryGovernor {
+private:
+    uint64_t m_softLimit;
+    uint64_t m_hardLimit;
+    uint64_t m_usage;
+    MemoryPressureLevel m_level;
+
+public:
+    MemoryGovernor() : m_softLimit(0), m_hardLimit(0), m_usage(0), m_level(MEMORY_PRESSURE_NONE) {
+    }
+
+    /// Set the limits, in bytes. A limit of 0 is disabled.
+    void setLimits(uint64_t softLimit, uint64_t hardLimit);
+
+    bool isEnabled() const {
+        return m_softLimit || m_hardLimit;
+    }
+
+    ///
+    /// \brief Compute the new pressure level
+    ///
+    /// \param usage the memory usage of the process in bytes
+    /// \return true if the level changed
+    ///
+    bool update(uint64_t usage);
+
+    MemoryPressureLevel getLevel() const {
+        return m_level;
+    }
+
+    uint64_t getUsage() const {
+        return m_usage;
+    }
+
+    bool allowProcessSplit() const {
+        return m_level < MEMORY_PRESSURE_NO_PROCESS_SPLIT;
+    }
+
+    bool allowStateFork() const {
+        return m_level < MEMORY_PRESSURE_NO_STATE_FORK;
+    }
+
+    bool shouldSwapStates() const {
+        return m_level >= MEMORY_PRESSURE_SWAP_STATES;
+    }
+};
+}
+
+#endif
@@ -10,6 +10,8 @@
 #define S2E_PLUGIN_H
 
 #include <fsigc++/fsigc++.h>
+#include <inttypes.h>
+#include <iosfwd>
 #include <map>
 #include <set>
 #include <string>
@@ -108,6 +110,29 @@ class PluginState {
 public:
     virtual ~PluginState(){};
     virtual PluginState *clone() const = 0;
+
+    /// Approximate number of bytes used by this plugin state.
+    /// Used for memory accounting, plugins with large states should override it.
+    virtual uint64_t getMemoryUsage() const {
+        return 0;
+    }
+
+    ///
+    /// \brief Write the plugin state to disk when its execution state is swapped out
+    ///
+    /// A plugin state that supports this writes its data to the stream and
+    /// frees the memory it does not need anymore. deserialize is called with
+    /// the same data before the execution state runs or forks again.
+    ///
+    /// \return false if the plugin state must stay in memory (the default)
+    ///
+    virtual bool serialize(std::ostream &os) {
+        return false;
+    }
+
+    /// Restore the data written by a successful call to serialize
+    virtual void deserialize(std::istream &is) {
+    }
 };
 
 struct PluginInfo {
@@ -38,6 +38,9 @@ private:
     uint8_t *m_stateBuffer;
     unsigned m_stateBufferSize;
 
+    /// Number of disk sectors written by the state
+    uint64_t m_sectorCount;
+
     static llvm::SmallVector<struct S2EBlockDevice *, 5> s_blockDevices;
     klee::AddressSpace m_deviceState;
 
@@ -62,6 +65,21 @@ public:
 
     int writeSector(struct S2EBlockDevice *bs, int64_t sector, const uint8_t *buf, int nb_sectors);
     int readSector(struct S2EBlockDevice *bs, int64_t sector, uint8_t *buf, int nb_sectors);
+
+    uint64_t getStateBufferSize() const {
+        return m_stateBufferSize;
+    }
+
+    const uint8_t *getStateBuffer() const {
+        return m_stateBuffer;
+    }
+
+    /// Free the device snapshot, once it is saved somewhere else
+    void releaseBuffer();
+
+    uint64_t getSectorBytes() const {
+        return m_sectorCount * SECTOR_SIZE;
+    }
 };
 }
 
@@ -14,6 +14,7 @@
 #include <klee/Memory.h>
 
 #include "AddressSpaceCache.h"
+#include "ConcretizationCache.h"
 #include "S2EDeviceState.h"
 #include "S2EExecutionStateMemory.h"
 #include "S2EExecutionStateRegisters.h"
@@ -34,6 +35,8 @@ struct CPUX86State;
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
 #include <tr1/unordered_map>
+#include <unordered_set>
+#include <utility>
 
 namespace s2e {
 
@@ -45,7 +48,7 @@ class S2EExecutionState;
 typedef std::unordered_map<const Plugin *, PluginState *> PluginStateMap;
 typedef PluginState *(*PluginStateFactory)(Plugin *p, S2EExecutionState *s);
 
-class S2EExecutionState : public klee::ExecutionState, public klee::IConcretizer {
+class S2EExecutionState : public klee::ExecutionState, public klee::IConcretizer, public IBulkConcretizer {
 protected:
     friend class S2EExecutor;
 
@@ -131,6 +134,46 @@ protected:
 
     S2EExecutionStateTlb m_tlb;
 
+    ConcretizationCache m_concretizationCache;
+
+    /// Incremented whenever the concolic assignment may have changed
+    uint64_t m_concolicsVersion;
+
+    /// Base addresses of the RAM pages that are split into subobjects
+    std::unordered_set<uint64_t> m_splitPages;
+
+    /// Split pages with a subobject that became concrete since the last coalescing pass
+    std::unordered_set<uint64_t> m_coalescingCandidates;
+
+    /// Number of split pages across all states
+    static uint64_t s_liveSplitPages;
+
+    /// Host time (in seconds) at which the state was last running
+    uint64_t m_lastActiveTime;
+
+    /// Set once a full pass of compressRam left compressed pages
+    bool m_ramCompressed;
+
+    /// Where the next call to compressRam resumes its pass
+    unsigned m_compressRegion;
+    uint64_t m_compressOffset;
+
+    /// Location of a serialized plugin state in m_stateFile
+    struct SpilledPluginState {
+        const Plugin *plugin;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::vector<SpilledPluginState> m_spilledPluginStates;
+
+    /// Size of the device snapshot in m_stateFile
+    uint64_t m_spilledDeviceStateSize;
+
+    /// Holds the concrete registers, the device snapshot and
+    /// the plugin states of a state written by spillMachineState
+    std::string m_stateFile;
+
     /* Temp location to store a symbolic mem_io_vaddr */
     klee::ref<klee::Expr> m_memIoVaddr;
 
@@ -149,6 +192,10 @@ protected:
 
     std::string getUniqueVarName(const std::string &name, std::string &rawVar);
 
+    bool coalescePage(uint64_t pageAddress);
+
+    bool findKleeObject(uint64_t address, unsigned size, klee::ObjectStateConstPtr &os, bool &inBounds);
+
 public:
     virtual void addressSpaceSymbolicStatusChange(const klee::ObjectStatePtr &object, bool becameConcrete);
 
@@ -337,10 +384,156 @@ public:
         return &m_tlb;
     }
 
+    ///
+    /// \brief Merge split RAM pages whose subobjects are all concrete again
+    ///
+    /// Splitting a page keeps symbolic data at a fine granularity, but every
+    /// later access to the page pays for the subobject lookup. This must be
+    /// called outside of translation block execution, as it replaces the
+    /// objects referenced by the TLB.
+    ///
+    /// \return the number of pages that were merged
+    ///
+    unsigned coalesceSplitPages();
+
+    bool hasCoalescingCandidates() const {
+        return !m_coalescingCandidates.empty();
+    }
+
+    size_t getSplitPageCount() const {
+        return m_splitPages.size();
+    }
+
+    static uint64_t getLiveSplitPageCount() {
+        return s_liveSplitPages;
+    }
+
+    /// Number of guest RAM pages of this state backed by the shared zero page
+    uint64_t getZeroBackedPageCount() const {
+        return m_asCache.getZeroBackedPageCount();
+    }
+
+    ///
+    /// \brief Compress the private RAM pages of an inactive state
+    ///
+    /// Pages that the saved TLB refers to are left alone. The others are
+    /// restored when they are accessed or when the state is resumed.
+    /// A pass over the RAM may be spread over several calls.
+    ///
+    /// \param regions host address and size of the RAM regions to scan
+    /// \param budget number of pages that may be visited, decremented by
+    /// the number of visited pages
+    /// \return the number of compressed pages
+    ///
+    unsigned compressRam(const std::vector<std::pair<uint64_t, uint64_t>> &regions, unsigned &budget);
+
+    /// Restore the pages compressed by compressRam
+    void decompressRam();
+
+    bool hasCompressedRam() const {
+        return m_asCache.hasCompressedPages();
+    }
+
+    ///
+    /// \brief Write the compressed RAM pages of the state to a file
+    ///
+    /// They are read back when the state is resumed or when one of
+    /// them is accessed.
+    ///
+    bool spillRam(const std::string &path) {
+        return m_asCache.spill(path);
+    }
+
+    bool isRamSpilled() const {
+        return m_asCache.isSpilled();
+    }
+
+    /// Bring the spilled pages back into memory without decompressing them
+    void loadSpilledRam() {
+        m_asCache.loadSpilledPages();
+        loadMachineState();
+    }
+
+    ///
+    /// \brief Write the non-RAM state of an inactive state to the given file
+    ///
+    /// This covers the concrete registers, the device snapshot and the plugin
+    /// states that support serialization, which are freed afterwards. The
+    /// symbolic registers, the constraints and the disk sectors hold KLEE
+    /// expressions or shared objects and stay in memory.
+    ///
+    /// \return false if the file could not be written, in which case
+    /// everything stays in memory
+    ///
+    bool spillMachineState(const std::string &path);
+
+    /// Restore the data written by spillMachineState
+    void loadMachineState();
+
+    bool isMachineStateSpilled() const {
+        return !m_stateFile.empty();
+    }
+
+    uint64_t getIdleTime() const;
+
     /*********************************************************/
 
     virtual uint64_t concretize(klee::ref<klee::Expr> expression, const std::string &reason, bool silent);
 
+    ///
+    /// \brief Concretize an expression and constrain it to the returned value
+    ///
+    /// This hides ExecutionState::toConstant in order to reuse values that
+    /// have already been computed under the current concolic assignment. The
+    /// KLEE methods are not virtual, so calls made through a
+    /// klee::ExecutionState reference do not use the cache.
+    ///
+    klee::ref<klee::ConstantExpr> toConstant(klee::ref<klee::Expr> e, const std::string &reason);
+
+    ///
+    /// \brief Get an example value of an expression without constraining it
+    ///
+    klee::ref<klee::ConstantExpr> toConstantSilent(klee::ref<klee::Expr> e);
+
+    ///
+    /// \brief Add a constraint and invalidate the concretization cache
+    ///
+    /// Forwards all arguments to ExecutionState::addConstraint, which
+    /// recomputes the concolic assignment if it violates the constraint.
+    ///
+    template <typename... Args> bool addConstraint(Args &&... args) {
+        ++m_concolicsVersion;
+        return klee::ExecutionState::addConstraint(std::forward<Args>(args)...);
+    }
+
+    /// Must be called after modifying or replacing the concolic assignment
+    void bumpConcolicsVersion() {
+        ++m_concolicsVersion;
+    }
+
+    ///
+    /// \brief Version of the concolic assignment, used to tag cached concretizations
+    ///
+    /// Concretized values are evaluated under the concolic assignment, which is
+    /// a model of the constraints, so they stay valid as long as it does not change.
+    ///
+    uint64_t getConcolicsVersion() const {
+        return m_concolicsVersion;
+    }
+
+    ///
+    /// \brief Concretize many bytes with one model and at most one constraint
+    ///
+    /// Concretizing bytes one by one adds one constraint per byte, which
+    /// quickly becomes expensive for large buffers (e.g., network packets).
+    ///
+    virtual void concretizeBytes(const std::vector<klee::ref<klee::Expr>> &bytes, uint8_t *result,
+                                 const std::string &reason, bool silent);
+
+    ConcretizationCache *getConcretizationCache() {
+        return &m_concretizationCache;
+    }
+
     S2EExecutionStateRegisters *regs() {
         return &m_registers;
     }
@@ -12,15 +12,48 @@
 
 #include <klee/IAddressSpaceNotification.h>
 #include <klee/IConcretizer.h>
+#include <string.h>
+#include <string>
+#include <vector>
 #include "AddressSpaceCache.h"
 
 namespace s2e {
 
 enum AddressType { VirtualAddress, PhysicalAddress, HostAddress };
 
+///
+/// \brief Concretizes a set of bytes with a single model
+///
+class IBulkConcretizer {
+public:
+    virtual ~IBulkConcretizer() {
+    }
+
+    ///
+    /// \brief Compute concrete values for all the given bytes at once
+    ///
+    /// \param bytes the expressions to concretize, each of them 8 bits wide
+    /// \param result where to store the concrete values
+    /// \param reason a description of why concretization is needed
+    /// \param silent if false, constrain the bytes to the returned values
+    ///
+    virtual void concretizeBytes(const std::vector<klee::ref<klee::Expr>> &bytes, uint8_t *result,
+                                 const std::string &reason, bool silent) = 0;
+};
+
 class S2EExecutionStateMemory {
+public:
+    static const unsigned HOST_ADDRESS_CACHE_BITS = 8;
+    static const unsigned HOST_ADDRESS_CACHE_SIZE = 1 << HOST_ADDRESS_CACHE_BITS;
 
 protected:
+    /// Caches the result of guest page table walks
+    struct HostAddressCacheEntry {
+        uint64_t pageDir;
+        uint64_t virtualPage;
+        uint64_t hostPage;
+    };
+
     static klee::ObjectKey s_dirtyMask;
     klee::ObjectStatePtr m_dirtyMask;
     const bool *m_active;
@@ -28,6 +61,16 @@ protected:
     klee::AddressSpace *m_addressSpace;
     klee::IAddressSpaceNotification *m_notification;
     klee::IConcretizer *m_concretizer;
+    IBulkConcretizer *m_bulkConcretizer;
+
+    /// Direct-mapped, indexed like the CPU TLB
+    mutable HostAddressCacheEntry m_hostAddressCache[HOST_ADDRESS_CACHE_SIZE];
+
+    void fillRamTlbEntry(struct CPUTLBRAMEntry *te, const klee::ObjectStateConstPtr &os);
+
+    /// Serve an access to an untouched lazy page from the shared zero page.
+    /// Return false if the page must get its own object first.
+    bool transferZeroPage(void *buf, uint64_t size, bool isWrite, bool isSymbolic);
 
     void transferRamInternalSymbolic(const klee::ObjectStateConstPtr &os, uint64_t object_offset,
                                      klee::ref<klee::Expr> *buf, uint64_t size, bool write);
@@ -39,15 +82,48 @@ protected:
 
     klee::ref<klee::Expr> readMemory8(uint64_t address, AddressType addressType = VirtualAddress);
 
+    /// Read a value that lies within a single object, or return null
+    /// if the access must be done byte by byte.
+    klee::ref<klee::Expr> readObject(uint64_t address, klee::Expr::Width width, AddressType addressType);
+
+    ///
+    /// \brief Get a pointer to the concrete data at the given address
+    ///
+    /// \param address the address of the data
+    /// \param size the maximum number of bytes needed
+    /// \param length receives the number of concrete bytes available at the
+    /// returned pointer, which never cross an object boundary
+    /// \return the pointer, or null if the first byte is symbolic or unmapped
+    ///
+    const uint8_t *getConcreteSpan(uint64_t address, uint64_t size, uint64_t *length,
+                                   AddressType addressType = VirtualAddress);
+
+    template <typename T> static unsigned findTerminator(const uint8_t *data, unsigned count) {
+        if (sizeof(T) == 1) {
+            const void *end = memchr(data, 0, count);
+            return end ? (const uint8_t *) end - data : count;
+        }
+
+        for (unsigned i = 0; i < count; ++i) {
+            T c;
+            memcpy(&c, data + i * sizeof(T), sizeof(T));
+            if (!c) {
+                return i;
+            }
+        }
+        return count;
+    }
+
 public:
     S2EExecutionStateMemory();
 
     void initialize(klee::AddressSpace *addressSpace, AddressSpaceCache *asCache, const bool *active,
                     klee::IAddressSpaceNotification *notification, klee::IConcretizer *concretizer,
-                    const klee::ObjectStatePtr &dirtyMask);
+                    IBulkConcretizer *bulkConcretizer, const klee::ObjectStatePtr &dirtyMask);
 
     void update(klee::AddressSpace *addressSpace, AddressSpaceCache *asCache, const bool *active,
-                klee::IAddressSpaceNotification *notification, klee::IConcretizer *concretizer);
+                klee::IAddressSpaceNotification *notification, klee::IConcretizer *concretizer,
+                IBulkConcretizer *bulkConcretizer);
 
     ////////////////////////////////////////////////////////////
     // The APIs below are for use by the engine only
@@ -66,11 +142,22 @@ public:
         return (uintptr_t) m_dirtyMask->getConcreteBuffer(false) - s_dirtyMask.address;
     }
 
+    /// Must be called whenever the CPU TLB is flushed
+    void flushHostAddressCache();
+
+    /// Must be called whenever the given entry of the CPU TLB is flushed
+    void flushHostAddressCachePage(unsigned tlbIndex);
+
     /// Read/write from physical memory, concretizing if necessary on reads.
     /// Note: this function accepts host address. Used by softmmu code.
     void transferRam(struct CPUTLBRAMEntry *te, uint64_t hostAddress, void *buf, uint64_t size, bool isWrite,
                      bool exitOnSymbolicRead, bool isSymbolic);
 
+    /// Point the given RAM TLB entry to the page that contains the host
+    /// address, if that page can be accessed directly (i.e., it is concrete
+    /// and not split). Used to resolve DMA transfers up front.
+    void fillRamTlb(struct CPUTLBRAMEntry *te, uint64_t hostAddress);
+
     klee::ObjectStateConstPtr getMemoryObject(uint64_t address, AddressType addressType = VirtualAddress) const;
 
     ///
@@ -177,6 +264,20 @@ public:
     ///
     bool symbolic(uint64_t address, uint64_t size, AddressType addressType = VirtualAddress);
 
+    ///
+    /// \brief Concretize all symbolic data in the given memory region
+    ///
+    /// All symbolic bytes of the region get their values from the same
+    /// model and are constrained with a single conjunction of equalities.
+    /// The concrete values are then written back to memory.
+    ///
+    /// \param address the beginning of the region
+    /// \param size the size of the region
+    /// \param addressType the type of address
+    /// \return true if the region could be concretized
+    ///
+    bool concretize(uint64_t address, uint64_t size, AddressType addressType = VirtualAddress);
+
     ///
     /// \brief Read symbolic data from memory
     ///
@@ -245,22 +346,44 @@ public:
     /// \return True if the string could be read, false otherwise
     ///
     template <typename T> bool readGenericString(uint64_t address, std::string &s, unsigned maxLen) {
-        s = "";
+        s.clear();
         bool ret = false;
-        T c;
 
-        do {
-            c = 0;
+        while (maxLen > 0) {
+            // Look for the terminator directly in the concrete data of the page
+            uint64_t length = 0;
+            const uint8_t *data = getConcreteSpan(address, (uint64_t) maxLen * sizeof(T), &length);
+            unsigned count = length / sizeof(T);
+            if (data && count) {
+                unsigned n = findTerminator<T>(data, count);
+                for (unsigned i = 0; i < n; ++i) {
+                    T c;
+                    memcpy(&c, data + i * sizeof(T), sizeof(T));
+                    s += (char) c;
+                }
+
+                if (n < count) {
+                    return true;
+                }
+
+                ret = true;
+                maxLen -= count;
+                address += count * sizeof(T);
+                continue;
+            }
 
+            // Symbolic, unmapped, or page-crossing character
+            T c = 0;
             ret = read(address, &c, sizeof(c));
             maxLen--;
             address += sizeof(T);
 
-            if (c) {
-                s = s + (char) c;
+            if (!c) {
+                break;
             }
 
-        } while (c && (maxLen > 0));
+            s += (char) c;
+        }
 
         return ret;
     }
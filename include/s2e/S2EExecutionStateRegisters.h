@@ -105,6 +105,21 @@ public:
         memcpy((void *) s_concreteRegs.address, (void *) m_concreteRegs->getConcreteBuffer(), s_concreteRegs.size);
     }
 
+    /// Saved concrete registers of an inactive state
+    const uint8_t *getSavedConcreteState() const {
+        return m_concreteRegs->getConcreteBuffer();
+    }
+
+    /// Unbind the concrete registers of an inactive state, once they are saved somewhere else
+    void releaseConcreteState(klee::AddressSpace &addressSpace);
+
+    ///
+    /// \brief Restore the concrete registers dropped by releaseConcreteState
+    ///
+    /// The caller must have bound a new object for the concrete registers.
+    ///
+    void reloadConcreteState(klee::AddressSpace &addressSpace, const uint8_t *data);
+
     void addressSpaceChange(const klee::ObjectKey &key, const klee::ObjectStateConstPtr &oldState,
                             const klee::ObjectStatePtr &newState);
 
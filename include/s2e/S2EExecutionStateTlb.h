@@ -23,24 +23,67 @@ struct CPUX86State;
 namespace s2e {
 
 class S2EExecutionStateTlb {
-public:
-    /**
-     * The following tracks the location of every ObjectState
-     * in the TLB in order to optimize TLB updates.
-     */
-    typedef std::pair<unsigned int, unsigned int> TlbCoordinates;
-    typedef llvm::SmallVector<TlbCoordinates, 8> ObjectStateTlbReferences;
-    typedef std::unordered_map<klee::ObjectStateConstPtr, ObjectStateTlbReferences, klee::ObjectStatePtrHash> TlbMap;
-
 private:
+    static const unsigned NO_SLOT = (unsigned) -1;
+
+    ///
+    /// \brief Back pointer from a TLB entry to the object it maps
+    ///
+    /// There is one slot per (mmu_idx, index) TLB entry. The slots that
+    /// map the same ObjectState are chained together, so that the entries
+    /// of an object can be updated or unlinked without searching or
+    /// allocating memory.
+    ///
+    struct TlbSlot {
+        unsigned prev;
+        unsigned next;
+
+        /// The slot is in m_ownedSlots if this matches m_ownershipGeneration
+        uint64_t ownershipGeneration;
+
+        /// The slot is in m_trackedSlots if this matches m_trackingGeneration
+        uint64_t trackingGeneration;
+    };
+
+    /// Maps an ObjectState to the first slot of its chain
+    typedef std::unordered_map<klee::ObjectStateConstPtr, unsigned, klee::ObjectStatePtrHash> TlbMap;
+
+    std::vector<TlbSlot> m_slots;
     TlbMap m_tlbMap;
+
+    /// Slots whose entry was granted write ownership in the current generation
+    std::vector<unsigned> m_ownedSlots;
+    uint64_t m_ownershipGeneration;
+
+    /// Slots that were filled or updated since beginTracking
+    std::vector<unsigned> m_trackedSlots;
+    uint64_t m_trackingGeneration;
+    bool m_tracking;
+
     AddressSpaceCache *m_asCache;
     S2EExecutionStateRegisters *m_registers;
 
+#if defined(SE_ENABLE_PHYSRAM_TLB)
+    /// Same fields as CPUTLBRAMEntry, which is private to libcpu
+    struct RamTlbEntry {
+        uintptr_t host_page;
+        uintptr_t addend;
+        void *object_state;
+    };
+
+    /// Entries recently evicted from se_ram_tlb
+    RamTlbEntry m_ramTlbVictims[S2E_RAM_TLB_VICTIMS];
+    unsigned m_ramTlbNextVictim;
+    unsigned m_ramTlbNextWay;
+#endif
+
+    void linkSlot(const klee::ObjectStateConstPtr &objectState, unsigned slot);
+    void unlinkSlot(const klee::ObjectStateConstPtr &objectState, unsigned slot);
+    void setOwned(struct CPUX86State *env, unsigned mmu_idx, unsigned index);
+    void track(unsigned slot);
+
 public:
-    S2EExecutionStateTlb(AddressSpaceCache *ascache, S2EExecutionStateRegisters *regs)
-        : m_asCache(ascache), m_registers(regs) {
-    }
+    S2EExecutionStateTlb(AddressSpaceCache *ascache, S2EExecutionStateRegisters *regs);
 
     void assignNewState(AddressSpaceCache *ascache, S2EExecutionStateRegisters *regs) {
         m_asCache = ascache;
@@ -60,16 +103,80 @@ public:
                                       const klee::ObjectStateConstPtr &state);
 
 #if defined(SE_ENABLE_PHYSRAM_TLB)
+    ///
+    /// \brief Get the RAM TLB entry for the given host address
+    ///
+    /// se_ram_tlb is used as a set-associative table. On a miss, this returns
+    /// an empty entry of the set that the caller may populate. The entry it
+    /// replaces goes to a small victim cache, so that a few regions accessed
+    /// in turn (e.g., DMA rings) do not keep evicting each other.
+    ///
+    struct CPUTLBRAMEntry *getRamTlbEntry(uint64_t hostAddress);
+
     void updateRamTlb(const klee::ObjectStateConstPtr &oldState, const klee::ObjectStatePtr &newState);
     void clearRamTlb();
 #endif
 
     void clearTlbOwnership();
 
+    /// Start recording the entries that get filled or updated
+    void beginTracking();
+
+    /// Stop recording without touching the TLB
+    void endTracking();
+
+    ///
+    /// \brief Invalidate the entries recorded since beginTracking
+    ///
+    /// This is a cheaper alternative to tlb_flush when only a few
+    /// entries changed, e.g., while finishing a TB in KLEE.
+    ///
+    /// \return the number of invalidated entries
+    ///
+    unsigned flushTrackedEntries(struct CPUX86State *env);
+
+    ///
+    /// \brief Invalidate the entries that refer to outdated objects
+    ///
+    /// The TLB is part of the saved CPU state, so a state that gets
+    /// resumed starts with the translations it had when it was suspended.
+    /// This checks them against the current objects of the address space.
+    ///
+    /// \return the number of invalidated entries
+    ///
+    unsigned dropStaleEntries();
+
+    /// Whether a CPU TLB or RAM TLB entry maps the given object
+    bool references(const klee::ObjectStateConstPtr &objectState) const;
+
     void updateTlbEntry(struct CPUX86State *env, int mmu_idx, uint64_t virtAddr, uint64_t hostAddr);
 
     bool audit();
 };
+
+///
+/// \brief Records the TLB entries updated while in scope
+///
+/// Tracking also stops if the scope is left through an exception.
+/// A longjmp out of the CPU loop skips the destructor, so
+/// cleanupTranslationBlock stops tracking as well.
+///
+class TlbTrackingScope {
+    S2EExecutionStateTlb *m_tlb;
+
+public:
+    TlbTrackingScope(S2EExecutionStateTlb *tlb) : m_tlb(tlb) {
+        if (m_tlb) {
+            m_tlb->beginTracking();
+        }
+    }
+
+    ~TlbTrackingScope() {
+        if (m_tlb) {
+            m_tlb->endTracking();
+        }
+    }
+};
 }
 
 #endif
@@ -10,9 +10,11 @@
 #define S2E_EXECUTOR_H
 
 #include <unordered_map>
+#include <unordered_set>
 
 #include <klee/Executor.h>
 #include <llvm/Support/raw_ostream.h>
+#include <s2e/MemoryGovernor.h>
 #include <s2e/s2e_libcpu.h>
 #include <timer.h>
 
@@ -36,6 +38,59 @@ class CpuExitException {};
 
 typedef void (*StateManagerCb)(S2EExecutionState *s, bool killingState);
 
+/// Memory used by a state, in bytes
+struct StateMemoryUsage {
+    /// RAM objects that this state owns, i.e., created or written since its last fork
+    uint64_t privateRamBytes = 0;
+
+    ///
+    /// RAM objects that this state does not own, i.e., inherited at fork
+    /// and not written since. They stay in this category even after all
+    /// the other states that shared them are gone.
+    ///
+    uint64_t sharedRamBytes = 0;
+
+    /// RAM pages compressed in memory (see -compress-idle-states)
+    uint64_t compressedRamBytes = 0;
+
+    /// Snapshot of the device state
+    uint64_t deviceStateBytes = 0;
+
+    /// Disk sectors written by the state or by its ancestors before it forked
+    uint64_t diskSectorBytes = 0;
+
+    /// As reported by PluginState::getMemoryUsage
+    uint64_t pluginStateBytes = 0;
+};
+
+/// Memory used by the process, broken down by subsystem
+struct MemoryUsageReport {
+    uint64_t residentBytes = 0;
+    uint64_t proportionalBytes = 0;
+
+    /// RAM objects of all states, shared objects are counted once
+    uint64_t ramObjectBytes = 0;
+
+    ///
+    /// Sums over all states. Compressed pages, device state snapshots and
+    /// plugin states are private to each state, so these are actual totals. Disk
+    /// sectors are copy-on-write like RAM, so a sector written before a fork
+    /// is counted once per descendant and diskSectorBytes may exceed the
+    /// memory they really use. Do not compare it with the RSS or PSS.
+    ///
+    uint64_t compressedRamBytes = 0;
+    uint64_t deviceStateBytes = 0;
+    uint64_t diskSectorBytes = 0;
+    uint64_t pluginStateBytes = 0;
+
+    /// Translation blocks with LLVM code and their number of LLVM instructions
+    uint64_t llvmTranslationBlocks = 0;
+    uint64_t llvmInstructions = 0;
+
+    /// Usage of the state that was running when the report was made
+    StateMemoryUsage currentState;
+};
+
 class S2EExecutor : public klee::Executor {
 protected:
     S2E *m_s2e;
@@ -52,6 +107,21 @@ protected:
 
     std::vector<S2EExecutionState *> m_deletedStates;
 
+    /// States dropped by load balancing that are not freed yet
+    std::vector<S2EExecutionState *> m_abandonedStates;
+
+    /// States removed from the searcher by suspendState
+    std::unordered_set<S2EExecutionState *> m_suspendedStates;
+
+    MemoryGovernor m_memoryGovernor;
+    unsigned m_memorySampleTicks;
+
+    /// States that the memory governor suspended
+    std::unordered_set<S2EExecutionState *> m_governorSuspendedStates;
+
+    MemoryUsageReport m_lastMemoryUsageReport;
+    uint64_t m_lastMemoryAccountingTime;
+
     bool m_executeAlwaysKlee;
 
     bool m_forkProcTerminateCurrentState;
@@ -152,6 +222,30 @@ public:
         return m_inLoadBalancing;
     }
 
+    const MemoryGovernor &getMemoryGovernor() const {
+        return m_memoryGovernor;
+    }
+
+    ///
+    /// \brief Compute the memory used by the given state
+    ///
+    /// This walks all the RAM pages of the state.
+    ///
+    StateMemoryUsage getStateMemoryUsage(S2EExecutionState *state);
+
+    ///
+    /// \brief Compute the memory used by the process and its subsystems
+    ///
+    /// This walks all the RAM pages of all the states, which may take
+    /// a while when there are many of them.
+    ///
+    MemoryUsageReport getMemoryUsageReport();
+
+    /// The report that was last logged in run.stats
+    const MemoryUsageReport &getLastMemoryUsageReport() const {
+        return m_lastMemoryUsageReport;
+    }
+
     /** Kills the specified state and raises an exception to exit the cpu loop */
     virtual void terminateState(klee::ExecutionState &state);
 
@@ -192,6 +286,31 @@ protected:
 
     void doLoadBalancing();
 
+    /// Free some of the states dropped by load balancing
+    void reclaimAbandonedStates();
+
+    /// Compress the RAM of the states that have not run for a while
+    void compressIdleStates();
+
+    /// Write the compressed RAM, the concrete registers, the device snapshot
+    /// and the serializable plugin states of a suspended state to disk
+    bool spillState(S2EExecutionState *state);
+
+    /// Write suspended states to disk when memory runs low
+    void swapOutStates();
+
+    /// Suspend and swap out the states that have been idle the longest
+    void swapOutIdleStates();
+
+    /// Resume up to count states suspended by the memory governor
+    void resumeGovernorSuspendedStates(unsigned count);
+
+    /// Sample the memory usage and apply the measures of the memory governor
+    void updateMemoryPressure();
+
+    void getStateMemoryUsage(S2EExecutionState *state, StateMemoryUsage &usage,
+                             std::unordered_set<const klee::ObjectState *> &ramObjects, uint64_t &ramObjectBytes);
+
     void notifyBranch(klee::ExecutionState &state);
 
     void setupTimersHandler();
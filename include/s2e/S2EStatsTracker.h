@@ -34,6 +34,40 @@ extern klee::Statistic totalBasicBlocks;
 extern klee::Statistic coveredBasicBlocks;
 
 extern klee::Statistic bugs;
+
+extern klee::Statistic concretizationCacheHits;
+extern klee::Statistic concretizationCacheMisses;
+
+extern klee::Statistic hostAddressCacheHits;
+extern klee::Statistic hostAddressCacheMisses;
+
+extern klee::Statistic splitRamObjects;
+extern klee::Statistic coalescedRamObjects;
+
+extern klee::Statistic tlbFlushesAvoided;
+extern klee::Statistic staleTlbEntries;
+
+extern klee::Statistic ramTlbMisses;
+extern klee::Statistic ramTlbConflicts;
+extern klee::Statistic ramTlbVictimHits;
+
+extern klee::Statistic materializedRamObjects;
+
+extern klee::Statistic compressedRamPages;
+extern klee::Statistic ramCompressionInputBytes;
+extern klee::Statistic ramCompressionOutputBytes;
+extern klee::Statistic decompressedRamPages;
+extern klee::Statistic ramDecompressionTime;
+
+extern klee::Statistic spilledRamPages;
+extern klee::Statistic spilledRamBytes;
+extern klee::Statistic ramSwapInTime;
+
+extern klee::Statistic memoryPressureDeferredForks;
+extern klee::Statistic memoryPressureSuspendedStates;
+
+extern klee::Statistic abandonedStates;
+extern klee::Statistic reclaimedStates;
 } // namespace stats
 } // namespace klee
 
@@ -46,6 +80,19 @@ public:
 
     static uint64_t getProcessMemoryUsage();
 
+    /// Physical memory currently used by the process, in bytes
+    static uint64_t getProcessResidentMemoryUsage();
+
+    ///
+    /// \brief Read the resident and proportional set sizes of the process
+    ///
+    /// The proportional set size divides the pages shared with other
+    /// processes (e.g., after load balancing) by the number of sharers.
+    ///
+    /// \return false if /proc/self/smaps_rollup is not available
+    ///
+    static bool getProcessSmapsRollup(uint64_t &rss, uint64_t &pss);
+
 protected:
     void writeStatsHeader();
     void writeStatsLine();
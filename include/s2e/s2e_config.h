@@ -23,4 +23,20 @@
 
 #include <cpu/se_libcpu_config.h>
 
+/** The granularity of guest RAM objects (SE_RAM_OBJECT_BITS) is chosen when
+    building libcpu, as the softmmu code depends on it. Everything in S2E derives
+    its layout from it. Supported sizes range from 1 KB to the size of a target
+    page (4 KB on x86), as the CPU TLB indexing and tag checks assume that
+    objects do not span several pages. */
+#define S2E_RAM_OBJECT_MIN_BITS 10
+#define S2E_RAM_OBJECT_MAX_BITS 12
+
+/** Each leaf of the memory cache covers at least 4 KB worth of objects */
+#define S2E_MEMCACHE_PAGE_BITS (SE_RAM_OBJECT_BITS > 12 ? SE_RAM_OBJECT_BITS : 12)
+
+/** Associativity of the physical RAM TLB (se_ram_tlb) and number of
+    entries of its victim cache */
+#define S2E_RAM_TLB_WAYS 4
+#define S2E_RAM_TLB_VICTIMS 8
+
 #endif // S2E_CONFIG_H
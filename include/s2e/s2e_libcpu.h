@@ -130,6 +130,10 @@ void s2e_increment_tb_stats(void *se_tb);
 void s2e_flush_tlb_cache(void);
 void se_flush_tlb_cache_page(void *objectState, int mmu_idx, int index);
 
+/* Called by tlb_flush_page for every flushed page, even if its
+   TLB entries do not hold a memory object */
+void se_flush_tlb_page(uint64_t vaddr);
+
 extern se_libcpu_tb_exec_t se_libcpu_tb_exec;
 
 /* Called by libcpu when execution is aborted using longjmp */
@@ -174,6 +178,16 @@ void se_write_dirty_mask(uint64_t host_address, uint8_t val);
 void s2e_dma_read(uint64_t hostAddress, uint8_t *buf, unsigned size);
 void s2e_dma_write(uint64_t hostAddress, uint8_t *buf, unsigned size);
 
+/* One contiguous piece of a scatter-gather DMA transfer */
+struct s2e_dma_segment {
+    uint64_t host_address;
+    uint8_t *buf;
+    unsigned size;
+};
+
+void s2e_dma_read_sg(const struct s2e_dma_segment *segments, unsigned count);
+void s2e_dma_write_sg(const struct s2e_dma_segment *segments, unsigned count);
+
 void s2e_on_privilege_change(unsigned previous, unsigned current);
 void s2e_on_page_directory_change(uint64_t previous, uint64_t current);
 
@@ -7,18 +7,323 @@
 ///
 
 #include <s2e/AddressSpaceCache.h>
+#include <s2e/S2EStatsTracker.h>
 #include <s2e/cpu.h>
 
+#include <klee/TimerStatIncrementer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 using namespace klee;
 
 namespace s2e {
 
-klee::ObjectStateConstPtr AddressSpaceCache::get(uintptr_t page_addr) {
+std::vector<AddressSpaceCache::LazyRamRegion> AddressSpaceCache::s_lazyRamRegions;
+uint64_t AddressSpaceCache::s_lazyRamPages = 0;
+
+static const uint8_t s_zeroPage[SE_RAM_OBJECT_SIZE] = {0};
+
+AddressSpaceCache::~AddressSpaceCache() {
+    if (!m_swapFile.empty()) {
+        unlink(m_swapFile.c_str());
+    }
+}
+
+const uint8_t *AddressSpaceCache::getZeroPage() {
+    return s_zeroPage;
+}
+
+void AddressSpaceCache::registerLazyRegion(uintptr_t hostAddress, uintptr_t size) {
+    assert((hostAddress & ~SE_RAM_OBJECT_MASK) == 0);
+    s_lazyRamRegions.push_back(LazyRamRegion{hostAddress, size});
+}
+
+void AddressSpaceCache::addLazyPages(uint64_t count) {
+    s_lazyRamPages += count;
+}
+
+bool AddressSpaceCache::isLazyPage(uintptr_t page_addr) {
+    for (const auto &region : s_lazyRamRegions) {
+        if (page_addr >= region.address && page_addr - region.address < region.size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+klee::ObjectStatePtr AddressSpaceCache::allocatePage(uintptr_t page_addr) {
+    auto os = ObjectState::allocate(page_addr, SE_RAM_OBJECT_SIZE, false);
+    os->setMemoryPage(true);
+    os->setSplittable(true);
+    os->setNotifyOnConcretenessChange(true);
+    return os;
+}
+
+klee::ObjectStatePtr AddressSpaceCache::materialize(uintptr_t page_addr) {
+    assert((page_addr & ~SE_RAM_OBJECT_MASK) == 0);
+
+    if (hasCompressedPages()) {
+        auto os = decompress(page_addr);
+        if (os) {
+            return os;
+        }
+    }
+
+    if (!isLazyPage(page_addr)) {
+        return nullptr;
+    }
+
+    assert(!m_addressSpace->findObject(page_addr));
+
+    auto os = allocatePage(page_addr);
+    memset(os->getConcreteBuffer(), 0, SE_RAM_OBJECT_SIZE);
+    m_addressSpace->bindObject(os);
+
+    ++m_materializedPages;
+    ++stats::materializedRamObjects;
+    return os;
+}
+
+// Pages are encoded as a sequence of 64-bit words. A control byte either
+// repeats the previous word (initially zero) 1 to 128 times or is followed
+// by 1 to 128 literal words. This is much faster than a general purpose
+// codec and does well on the mostly empty or filled pages of guests.
+static bool compressPage(const uint8_t *page, std::vector<uint8_t> &out) {
+    const uint64_t *words = (const uint64_t *) page;
+    const unsigned count = SE_RAM_OBJECT_SIZE / sizeof(*words);
+    uint64_t previous = 0;
+
+    out.clear();
+    for (unsigned i = 0; i < count;) {
+        unsigned run = 0;
+        while (i + run < count && run < 128 && words[i + run] == previous) {
+            ++run;
+        }
+
+        if (run) {
+            out.push_back(run - 1);
+            i += run;
+            continue;
+        }
+
+        unsigned start = i;
+        do {
+            previous = words[i++];
+        } while (i < count && i - start < 128 && words[i] != previous);
+
+        out.push_back(0x80 | (i - start - 1));
+        out.insert(out.end(), (const uint8_t *) &words[start], (const uint8_t *) &words[i]);
+
+        if (out.size() >= SE_RAM_OBJECT_SIZE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void decompressPage(const std::vector<uint8_t> &in, uint8_t *page) {
+    uint64_t *words = (uint64_t *) page;
+    uint64_t previous = 0;
+    unsigned i = 0;
+
+    for (size_t pos = 0; pos < in.size();) {
+        uint8_t control = in[pos++];
+        unsigned count = (control & 0x7f) + 1;
+
+        if (control & 0x80) {
+            memcpy(&words[i], &in[pos], count * sizeof(*words));
+            pos += count * sizeof(*words);
+            i += count;
+            previous = words[i - 1];
+        } else {
+            for (; count; --count) {
+                words[i++] = previous;
+            }
+        }
+    }
+
+    assert(i == SE_RAM_OBJECT_SIZE / sizeof(*words));
+}
+
+bool AddressSpaceCache::compress(uintptr_t page_addr) {
+    assert((page_addr & ~SE_RAM_OBJECT_MASK) == 0);
+
+    auto os = m_addressSpace->findObject(page_addr);
+    if (!os || os->isSharedConcrete() || !os->isMemoryPage() || os->getSize() != SE_RAM_OBJECT_SIZE ||
+        !os->isAllConcrete() || !isOwnedByUs(os)) {
+        return false;
+    }
+
+    std::vector<uint8_t> data;
+    if (!compressPage(os->getConcreteBuffer(), data)) {
+        return false;
+    }
+
+    stats::ramCompressionInputBytes += SE_RAM_OBJECT_SIZE;
+    stats::ramCompressionOutputBytes += data.size();
+    ++stats::compressedRamPages;
+
+    data.shrink_to_fit();
+    m_compressedPages[page_addr] = std::move(data);
+    m_addressSpace->unbindObject(os->getKey());
+    invalidate(page_addr);
+    return true;
+}
+
+klee::ObjectStatePtr AddressSpaceCache::decompress(uintptr_t page_addr) {
+    auto it = m_compressedPages.find(page_addr);
+    if (it == m_compressedPages.end()) {
+        if (!loadSpilledPage(page_addr)) {
+            return nullptr;
+        }
+        it = m_compressedPages.find(page_addr);
+    }
+
+    auto os = allocatePage(page_addr);
+    decompressPage(it->second, os->getConcreteBuffer());
+    m_addressSpace->bindObject(os);
+    m_compressedPages.erase(it);
+
+    ++stats::decompressedRamPages;
+    return os;
+}
+
+unsigned AddressSpaceCache::decompressAll() {
+    loadSpilledPages();
+
+    TimerStatIncrementer t(stats::ramDecompressionTime);
+
+    std::vector<uintptr_t> pages;
+    for (auto &it : m_compressedPages) {
+        pages.push_back(it.first);
+    }
+
+    for (auto page : pages) {
+        decompress(page);
+    }
+
+    return pages.size();
+}
+
+bool AddressSpaceCache::spill(const std::string &path) {
+    assert(m_swapFile.empty());
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    std::unordered_map<uintptr_t, SpilledPage> spilledPages;
+    uint64_t offset = 0;
+    for (auto &it : m_compressedPages) {
+        const auto &data = it.second;
+        if (write(fd, data.data(), data.size()) != (ssize_t) data.size()) {
+            close(fd);
+            unlink(path.c_str());
+            return false;
+        }
+
+        spilledPages[it.first] = SpilledPage{offset, data.size()};
+        offset += data.size();
+    }
+
+    close(fd);
+
+    stats::spilledRamPages += spilledPages.size();
+    stats::spilledRamBytes += offset;
+
+    m_compressedPages.clear();
+    m_spilledPages = std::move(spilledPages);
+    m_swapFile = path;
+    return true;
+}
+
+static void readSpilledPage(int fd, const std::string &path, uint64_t offset, std::vector<uint8_t> &data) {
+    if (fd < 0 || pread(fd, data.data(), data.size(), offset) != (ssize_t) data.size()) {
+        llvm::errs() << "Could not read RAM pages back from " << path << "\n";
+        exit(-1);
+    }
+}
+
+bool AddressSpaceCache::loadSpilledPage(uintptr_t page_addr) {
+    auto it = m_spilledPages.find(page_addr);
+    if (it == m_spilledPages.end()) {
+        return false;
+    }
+
+    TimerStatIncrementer t(stats::ramSwapInTime);
+
+    auto &data = m_compressedPages[page_addr];
+    data.resize(it->second.size);
+
+    int fd = open(m_swapFile.c_str(), O_RDONLY);
+    readSpilledPage(fd, m_swapFile, it->second.offset, data);
+    close(fd);
+
+    m_spilledPages.erase(it);
+    if (m_spilledPages.empty()) {
+        unlink(m_swapFile.c_str());
+        m_swapFile.clear();
+    }
+
+    return true;
+}
+
+void AddressSpaceCache::loadSpilledPages() {
+    if (m_swapFile.empty()) {
+        return;
+    }
+
+    TimerStatIncrementer t(stats::ramSwapInTime);
+
+    int fd = open(m_swapFile.c_str(), O_RDONLY);
+    for (auto &it : m_spilledPages) {
+        auto &data = m_compressedPages[it.first];
+        data.resize(it.second.size);
+        readSpilledPage(fd, m_swapFile, it.second.offset, data);
+    }
+    close(fd);
+
+    m_spilledPages.clear();
+    unlink(m_swapFile.c_str());
+    m_swapFile.clear();
+}
+
+uint64_t AddressSpaceCache::getCompressedBytes() const {
+    uint64_t bytes = 0;
+    for (auto &it : m_compressedPages) {
+        bytes += it.second.size();
+    }
+    return bytes;
+}
+
+klee::ObjectStateConstPtr AddressSpaceCache::find(uintptr_t page_addr) {
     assert((page_addr & ~SE_RAM_OBJECT_MASK) == 0);
 
     auto os = m_memcache.get(page_addr);
     if (!os) {
         os = m_addressSpace->findObject(page_addr);
+        if (!os && hasCompressedPages()) {
+            os = decompress(page_addr);
+        }
+        if (os) {
+            m_memcache.put(page_addr, os);
+        }
+    }
+
+    return os;
+}
+
+klee::ObjectStateConstPtr AddressSpaceCache::get(uintptr_t page_addr) {
+    assert((page_addr & ~SE_RAM_OBJECT_MASK) == 0);
+
+    auto os = find(page_addr);
+    if (!os) {
+        os = materialize(page_addr);
         m_memcache.put(page_addr, os);
     }
 
@@ -50,7 +355,7 @@ klee::ObjectStatePtr AddressSpaceCache::getBaseObject(const klee::ObjectStatePtr
 
 klee::ObjectStatePtr AddressSpaceCache::notifySplit(const klee::ObjectStateConstPtr &oldObject,
                                                     const std::vector<klee::ObjectStatePtr> &newObjects) {
-    assert(oldObject->isSplittable() && oldObject->getSize() == TARGET_PAGE_SIZE);
+    assert(oldObject->isSplittable() && oldObject->getSize() == SE_RAM_OBJECT_SIZE);
     assert(newObjects.size() == SE_RAM_OBJECT_SIZE / S2E_RAM_SUBOBJECT_SIZE);
 
     ObjectStatePtr baseObject = nullptr;
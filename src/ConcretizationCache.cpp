@@ -0,0 +1,53 @@
+///
+/// Copyright (C) 2016, Cyberhaven
+/// All rights reserved.
+///
+/// Licensed under the Cyberhaven Research License Agreement.
+///
+
+#include <s2e/ConcretizationCache.h>
+#include <s2e/S2EStatsTracker.h>
+
+using namespace klee;
+
+namespace s2e {
+
+const ConcretizationCache::Entry *ConcretizationCache::get(const ref<Expr> &expr, uint64_t version) const {
+    if (version != m_version) {
+        ++stats::concretizationCacheMisses;
+        return nullptr;
+    }
+
+    auto it = m_entries->find(expr);
+    if (it == m_entries->end()) {
+        ++stats::concretizationCacheMisses;
+        return nullptr;
+    }
+
+    ++stats::concretizationCacheHits;
+    return &(*it).second;
+}
+
+void ConcretizationCache::put(const ref<Expr> &expr, uint64_t version, const ref<ConstantExpr> &value,
+                              bool constrained) {
+    if (version != m_version) {
+        invalidate();
+        m_version = version;
+    } else if (m_entries.use_count() > 1) {
+        // The map is still shared with a parent or child state
+        m_entries = std::make_shared<Map>(*m_entries);
+    }
+
+    Entry &entry = (*m_entries)[expr];
+    entry.value = value;
+    entry.constrained = constrained;
+}
+
+void ConcretizationCache::invalidate() {
+    if (m_entries.use_count() > 1) {
+        m_entries = std::make_shared<Map>();
+    } else {
+        m_entries->clear();
+    }
+}
+}
@@ -448,6 +448,8 @@ void s2e_on_privilege_change(unsigned previous, unsigned current) {
 void s2e_on_page_directory_change(uint64_t previous, uint64_t current) {
     assert(g_s2e_state->isActive());
 
+    g_s2e_state->mem()->flushHostAddressCache();
+
     try {
         g_s2e->getCorePlugin()->onPageDirectoryChange.emit(g_s2e_state, previous, current);
     } catch (s2e::CpuExitException &) {
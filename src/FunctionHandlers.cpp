@@ -47,7 +47,7 @@ void handleForkAndConcretize(Executor *executor, ExecutionState *state, klee::KI
         return;
     }
 
-    auto concreteAddress = state->toConstantSilent(address);
+    auto concreteAddress = s2eState->toConstantSilent(address);
 
     bool doConcretize = false;
 
@@ -239,6 +239,8 @@ static void handlerTraceMmioAccess(Executor *executor, ExecutionState *state, kl
                                    std::vector<klee::ref<klee::Expr>> &args) {
     assert(args.size() == 4);
 
+    S2EExecutionState *s2eState = static_cast<S2EExecutionState *>(state);
+
     auto symbolicPhysAddress = args[0];
     if (!g_symbolicMemoryHook.hasHook()) {
         // Avoid forced concretizations if symbolic hardware is not enabled
@@ -246,7 +248,7 @@ static void handlerTraceMmioAccess(Executor *executor, ExecutionState *state, kl
         return;
     }
 
-    uint64_t physAddress = state->toConstant(symbolicPhysAddress, "MMIO address")->getZExtValue();
+    uint64_t physAddress = s2eState->toConstant(symbolicPhysAddress, "MMIO address")->getZExtValue();
     klee::ref<Expr> value = args[1];
     unsigned size = cast<klee::ConstantExpr>(args[2])->getZExtValue();
 
@@ -274,7 +276,7 @@ static void handlerTracePortAccess(Executor *executor, ExecutionState *state, kl
     assert(args.size() == 4);
     S2EExecutionState *s2eState = static_cast<S2EExecutionState *>(state);
 
-    klee::ref<klee::ConstantExpr> port = state->toConstant(args[0], "Symbolic I/O port");
+    klee::ref<klee::ConstantExpr> port = s2eState->toConstant(args[0], "Symbolic I/O port");
     klee::ref<Expr> inputValue = args[1];
     klee::Expr::Width width = cast<klee::ConstantExpr>(args[2])->getZExtValue();
     klee::ref<Expr> resizedValue = klee::ExtractExpr::create(inputValue, 0, width);
@@ -288,7 +290,7 @@ static void handlerTracePortAccess(Executor *executor, ExecutionState *state, kl
         }
 
         if (callOrig) {
-            state->toConstant(resizedValue, "Symbolic I/O port value");
+            s2eState->toConstant(resizedValue, "Symbolic I/O port value");
         }
 
         state->bindLocal(target, klee::ConstantExpr::create(callOrig, klee::Expr::Int64));
@@ -16,14 +16,31 @@
 #include <s2e/SymbolicHardwareHook.h>
 #include <s2e/s2e_libcpu.h>
 
+#include <klee/Solver.h>
+#include <klee/SolverManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
 
 #include <cpu/memory.h>
 
 using namespace klee;
 
+namespace {
+// Forking on every feasible value of a symbolic address explodes on table lookups.
+// When this is non-zero, reads through a symbolic address that may only hit
+// a bounded number of pages fork once per page instead, and each page is
+// read with a symbolic offset. Accesses spanning more pages are concretized.
+llvm::cl::opt<unsigned>
+    SymbolicAddressMaxPages("symbolic-address-max-pages",
+                            llvm::cl::desc("Maximum number of pages a symbolic read address may span to be resolved "
+                                           "by forking once per page (0 to always concretize)"),
+                            llvm::cl::init(0));
+}
+
 namespace s2e {
 
+static_assert(S2E_RAM_OBJECT_MAX_BITS <= TARGET_PAGE_BITS, "RAM objects must not be larger than a target page (4 KB)");
+
 #define S2E_RAM_OBJECT_DIFF (TARGET_PAGE_BITS - SE_RAM_OBJECT_BITS)
 #ifdef SOFTMMU_CODE_ACCESS
 #define READ_ACCESS_TYPE 2
@@ -182,6 +199,94 @@ static ref<ConstantExpr> handleForkAndConcretizeNative(Executor *executor, Execu
     return constantAddress;
 }
 
+///
+/// \brief Read memory through a symbolic address without concretizing it
+///
+/// The state is forked at most once per page that the address may hit. In the
+/// current state, the address is constrained to the page of its example value
+/// and the data is read from that page with a symbolic offset.
+///
+/// \param symbAddress the address, which is replaced by its example value if
+/// a plugin asks for concretization
+/// \return true if the read was served, false if the caller must concretize
+///
+static bool readSymbolicAddressPage(Executor *executor, S2EExecutionState *state, CPUArchState *env,
+                                    ref<Expr> &symbAddress, unsigned mmu_idx, unsigned data_size, ref<Expr> &value) {
+    S2EExecutor *s2eExecutor = static_cast<S2EExecutor *>(executor);
+    Expr::Width addressWidth = symbAddress->getWidth();
+
+    auto concreteAddress = state->toConstantSilent(symbAddress);
+    target_ulong addr = concreteAddress->getZExtValue();
+
+    // Page-crossing accesses are rare, let the slow path deal with them
+    if ((addr & ~SE_RAM_OBJECT_MASK) + data_size > SE_RAM_OBJECT_SIZE) {
+        return false;
+    }
+
+    // Filling the TLB could raise a guest page fault for an address that
+    // is still symbolic, leave this to the slow path too.
+    target_ulong object_index = addr >> SE_RAM_OBJECT_BITS;
+    target_ulong index = (object_index >> S2E_RAM_OBJECT_DIFF) & (CPU_TLB_SIZE - 1);
+    const auto &tlbEntry = env->tlb_table[mmu_idx][index];
+    if ((addr & TARGET_PAGE_MASK) != (tlbEntry.ADDR_READ & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        return false;
+    }
+
+    if ((tlbEntry.ADDR_READ & ~TLB_MEM_TRACE) & ~TARGET_PAGE_MASK) {
+        // I/O memory
+        return false;
+    }
+
+    uintptr_t hostPage = (addr & SE_RAM_OBJECT_MASK) + tlbEntry.addend;
+    auto os = state->mem()->getMemoryObject(hostPage, HostAddress);
+    if (!os || os->isSharedConcrete() || os->getSize() != SE_RAM_OBJECT_SIZE ||
+        os->getBitArraySize() != os->getSize()) {
+        return false;
+    }
+
+    Solver *solver = SolverManager::solver()->solver;
+    auto range = solver->getRange(Query(state->constraints(), symbAddress));
+    uint64_t minPage = cast<ConstantExpr>(range.first)->getZExtValue() >> SE_RAM_OBJECT_BITS;
+    uint64_t maxPage = cast<ConstantExpr>(range.second)->getZExtValue() >> SE_RAM_OBJECT_BITS;
+    if (maxPage - minPage >= SymbolicAddressMaxPages) {
+        return false;
+    }
+
+    ref<Expr> castedAddress = symbAddress;
+    if (state->getPointerSize() == sizeof(uint32_t)) {
+        castedAddress = ExtractExpr::create(symbAddress, 0, Expr::Int32);
+    }
+
+    bool doConcretize = false;
+    g_s2e->getCorePlugin()->onSymbolicAddress.emit(state, castedAddress, addr, doConcretize,
+                                                   CorePlugin::symbolicAddressReason::MEMORY);
+    if (doConcretize) {
+        if (!state->addConstraint(EqExpr::create(concreteAddress, symbAddress))) {
+            abort();
+        }
+        // The caller reads from the now constant address without notifying plugins again
+        symbAddress = concreteAddress;
+        return false;
+    }
+
+    // Keep the address symbolic, but confine it to the page of the example value.
+    // The other state will re-execute the access and pick its own page.
+    ref<Expr> pageOffset = SubExpr::create(symbAddress, ConstantExpr::create(addr & SE_RAM_OBJECT_MASK, addressWidth));
+    ref<Expr> condition =
+        UleExpr::create(pageOffset, ConstantExpr::create(SE_RAM_OBJECT_SIZE - data_size, addressWidth));
+
+    Executor::StatePair sp = s2eExecutor->fork(*state, condition);
+    assert(sp.first == state);
+    if (sp.second) {
+        sp.second->pc = sp.second->prevPC;
+    }
+
+    s2eExecutor->notifyFork(*state, condition, sp);
+
+    value = os->read(ExtractExpr::create(pageOffset, 0, Expr::Int32), data_size * 8);
+    return true;
+}
+
 template <typename V>
 static ref<Expr> handle_ldst_mmu(Executor *executor, ExecutionState *state, klee::KInstruction *target, const V &args,
                                  bool isWrite, unsigned data_size, bool signExtend, bool zeroExtend) {
@@ -191,14 +296,37 @@ static ref<Expr> handle_ldst_mmu(Executor *executor, ExecutionState *state, klee
     assert(!envExpr.isNull());
     CPUArchState *env = (CPUArchState *) envExpr->getZExtValue();
 
-    const auto &symbAddress = args[1];
-    ref<ConstantExpr> constantAddress = handleForkAndConcretizeNative(executor, state, target, symbAddress);
+    ref<Expr> symbAddress = args[1];
 
     ref<Expr> mmuIdxExpr = args[isWrite ? 3 : 2];
     unsigned mmu_idx = dyn_cast<ConstantExpr>(mmuIdxExpr)->getZExtValue() & 0xf;
 
     // XXX: determine this by looking at the instruction that called us
     Expr::Width width = data_size * 8;
+
+    if (!isWrite && SymbolicAddressMaxPages && !isa<ConstantExpr>(symbAddress)) {
+        ref<Expr> value;
+        if (readSymbolicAddressPage(executor, s2estate, env, symbAddress, mmu_idx, data_size, value)) {
+            auto corePlugin = g_s2e->getCorePlugin();
+            if (!corePlugin->onAfterSymbolicDataMemoryAccess.empty()) {
+                std::vector<ref<Expr>> traceArgs;
+                traceArgs.push_back(symbAddress);
+                traceArgs.push_back(value);
+                traceArgs.push_back(ConstantExpr::create(width / 8, Expr::Int32));
+                traceArgs.push_back(ConstantExpr::create(0, Expr::Int64));
+                traceArgs.push_back(ConstantExpr::create(0, Expr::Int64));
+                handlerAfterMemoryAccess(executor, state, target, traceArgs);
+            }
+
+            if (zeroExtend) {
+                assert(data_size == 2);
+                value = ZExtExpr::create(value, Expr::Int32);
+            }
+            return value;
+        }
+    }
+
+    ref<ConstantExpr> constantAddress = handleForkAndConcretizeNative(executor, state, target, symbAddress);
     Expr::Width addressWidth = symbAddress->getWidth();
 
     target_ulong addr = constantAddress->getZExtValue();
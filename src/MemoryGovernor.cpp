@@ -0,0 +1,51 @@
+///
+/// Copyright (C) 2016, Cyberhaven
+/// All rights reserved.
+///
+/// Licensed under the Cyberhaven Research License Agreement.
+///
+
+#include <s2e/MemoryGovernor.h>
+
+namespace s2e {
+
+void MemoryGovernor::setLimits(uint64_t softLimit, uint64_t hardLimit) {
+    // A single limit acts as both
+    m_softLimit = softLimit ? softLimit : hardLimit;
+    m_hardLimit = hardLimit ? hardLimit : softLimit;
+    if (m_softLimit > m_hardLimit) {
+        m_softLimit = m_hardLimit;
+    }
+}
+
+bool MemoryGovernor::update(uint64_t usage) {
+    MemoryPressureLevel level;
+
+    m_usage = usage;
+
+    if (!isEnabled() || usage < m_softLimit) {
+        level = MEMORY_PRESSURE_NONE;
+    } else if (usage < m_hardLimit) {
+        // Keep forks disabled until the usage goes below the soft limit,
+        // but only swap states out while it stays above the hard limit
+        if (m_level < MEMORY_PRESSURE_NO_PROCESS_SPLIT) {
+            level = MEMORY_PRESSURE_NO_PROCESS_SPLIT;
+        } else if (m_level > MEMORY_PRESSURE_NO_STATE_FORK) {
+            level = MEMORY_PRESSURE_NO_STATE_FORK;
+        } else {
+            level = m_level;
+        }
+    } else if (m_level < MEMORY_PRESSURE_NO_STATE_FORK) {
+        level = MEMORY_PRESSURE_NO_STATE_FORK;
+    } else {
+        level = MEMORY_PRESSURE_SWAP_STATES;
+    }
+
+    if (level == m_level) {
+        return false;
+    }
+
+    m_level = level;
+    return true;
+}
+}
@@ -48,7 +48,8 @@ void s2e_init_device_state(void) {
 
 } // extern C
 
-S2EDeviceState::S2EDeviceState(const S2EDeviceState &state) : m_deviceState(state.m_deviceState) {
+S2EDeviceState::S2EDeviceState(const S2EDeviceState &state)
+    : m_sectorCount(state.m_sectorCount), m_deviceState(state.m_deviceState) {
     if (state.m_stateBuffer) {
         m_stateBuffer = (uint8_t *) malloc(state.m_stateBufferSize);
         m_stateBufferSize = state.m_stateBufferSize;
@@ -59,7 +60,7 @@ S2EDeviceState::S2EDeviceState(const S2EDeviceState &state) : m_deviceState(stat
     }
 }
 
-S2EDeviceState::S2EDeviceState(klee::ExecutionState *state) : m_deviceState(state) {
+S2EDeviceState::S2EDeviceState(klee::ExecutionState *state) : m_sectorCount(0), m_deviceState(state) {
     m_stateBuffer = nullptr;
     m_stateBufferSize = 0;
 }
@@ -93,6 +94,12 @@ void S2EDeviceState::allocateBuffer(unsigned int size) {
     m_stateBufferSize = size;
 }
 
+void S2EDeviceState::releaseBuffer() {
+    free(m_stateBuffer);
+    m_stateBuffer = nullptr;
+    m_stateBufferSize = 0;
+}
+
 int S2EDeviceState::putBuffer(const uint8_t *buf, int64_t pos, int size) {
     uint8_t *dest;
 
@@ -143,6 +150,7 @@ int S2EDeviceState::writeSector(struct S2EBlockDevice *bs, int64_t sector, const
             auto mo = ObjectState::allocate(address, SECTOR_SIZE, true);
             m_deviceState.bindObject(mo);
             os = mo;
+            ++m_sectorCount;
         }
 
         auto osw = m_deviceState.getWriteable(os);
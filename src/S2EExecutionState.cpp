@@ -26,12 +26,15 @@
 
 #include <klee/util/ExprPPrinter.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/TimeValue.h>
 #include <s2e/CorePlugin.h>
 
 #include <tcg/tcg-llvm.h>
 
+#include <fstream>
 #include <iomanip>
 #include <sstream>
+#include <unistd.h>
 
 namespace klee {
 extern llvm::cl::opt<bool> DebugLogStateMerge;
@@ -50,6 +53,8 @@ namespace s2e {
 
 using namespace klee;
 
+uint64_t S2EExecutionState::s_liveSplitPages = 0;
+
 unsigned S2EExecutionState::s_lastSymbolicId = 0;
 
 S2EExecutionState::S2EExecutionState(klee::KFunction *kf)
@@ -62,6 +67,12 @@ S2EExecutionState::S2EExecutionState(klee::KFunction *kf)
     // XXX: make this a struct, not a pointer...
     m_timersState = new TimersState;
     m_guid = m_stateID;
+    m_lastActiveTime = llvm::sys::TimeValue::now().seconds();
+    m_ramCompressed = false;
+    m_compressRegion = 0;
+    m_compressOffset = 0;
+    m_spilledDeviceStateSize = 0;
+    m_concolicsVersion = 0;
 }
 
 S2EExecutionState::~S2EExecutionState() {
@@ -77,12 +88,18 @@ S2EExecutionState::~S2EExecutionState() {
         delete it->second;
     }
 
+    if (!m_stateFile.empty()) {
+        unlink(m_stateFile.c_str());
+    }
+
     g_s2e->refreshPlugins();
 
     // XXX: This cannot be done, as device states may refer to each other
     // delete m_deviceState;
 
     delete m_timersState;
+
+    s_liveSplitPages -= m_splitPages.size();
 }
 
 void S2EExecutionState::assignGuid(uint64_t guid) {
@@ -113,6 +130,12 @@ ExecutionState *S2EExecutionState::clone() {
     ret->m_timersState = new TimersState;
     *ret->m_timersState = *m_timersState;
 
+    s_liveSplitPages += ret->m_splitPages.size();
+    ret->m_lastActiveTime = llvm::sys::TimeValue::now().seconds();
+    ret->m_ramCompressed = false;
+    ret->m_compressRegion = 0;
+    ret->m_compressOffset = 0;
+
     // Clone the plugins
     PluginStateMap::iterator it;
     ret->m_PluginState.clear();
@@ -128,8 +151,8 @@ ExecutionState *S2EExecutionState::clone() {
 
     m_registers.update(addressSpace, &m_active, &m_runningConcrete, this, this);
 
-    m_memory.update(&addressSpace, &m_asCache, &m_active, this, this);
-    ret->m_memory.update(&ret->addressSpace, &ret->m_asCache, &ret->m_active, ret, ret);
+    m_memory.update(&addressSpace, &m_asCache, &m_active, this, this, this);
+    ret->m_memory.update(&ret->addressSpace, &ret->m_asCache, &ret->m_active, ret, ret, ret);
 
     return ret;
 }
@@ -386,7 +409,7 @@ void S2EExecutionState::kleeReadMemory(ref<Expr> kleeAddressExpr, uint64_t sizeI
 
 #ifdef CONFIG_SYMBEX_MP
     bool inBounds;
-    if (!addressSpace.findObject(address->getZExtValue(), sizeInBytes, os, inBounds)) {
+    if (!findKleeObject(address->getZExtValue(), sizeInBytes, os, inBounds)) {
         pabort("kleeReadMemory: out of bounds / multiple resolution unhandled");
     }
 
@@ -398,28 +421,32 @@ void S2EExecutionState::kleeReadMemory(ref<Expr> kleeAddressExpr, uint64_t sizeI
     // Read an array of bytes
     unsigned i;
     sizeInBytes = sizeInBytes >= os->getSize() ? os->getSize() : sizeInBytes;
-    for (i = 0; i < sizeInBytes; i++) {
-        ref<Expr> cur = os->read8(i);
-        if (requireConcrete) {
+    if (requireConcrete) {
+        for (i = 0; i < sizeInBytes; i++) {
             // Here, we demand concrete results
-            cur = toUnique(cur);
+            ref<Expr> cur = toUnique(os->read8(i));
             assert(isa<klee::ConstantExpr>(cur) && "kleeReadMemory: hit symbolic char but expected concrete data");
             if (result) {
                 result->push_back(cast<klee::ConstantExpr>(cur));
             }
-        } else {
-            if (concretize && addConstraint) {
-                // Add constraint if necessary
-                cur = this->toConstant(cur, "kleeReadMemory");
-            } else if (concretize && !addConstraint) {
-                // Otherwise just get an example
-                cur = this->toConstantSilent(cur);
-            } else {
-                pabort("Expected reasonable parameters in kleeReadMemory");
-            }
+        }
+    } else {
+        if (!concretize) {
+            pabort("Expected reasonable parameters in kleeReadMemory");
+        }
 
-            if (result) {
-                result->push_back(cur);
+        std::vector<ref<Expr>> bytes(sizeInBytes);
+        for (i = 0; i < sizeInBytes; i++) {
+            bytes[i] = os->read8(i);
+        }
+
+        // Without addConstraint, just get an example
+        std::vector<uint8_t> concreteBytes(sizeInBytes);
+        concretizeBytes(bytes, concreteBytes.data(), "kleeReadMemory", !addConstraint);
+
+        if (result) {
+            for (i = 0; i < sizeInBytes; i++) {
+                result->push_back(ConstantExpr::create(concreteBytes[i], Expr::Int8));
             }
         }
     }
@@ -438,6 +465,19 @@ void S2EExecutionState::kleeReadMemory(ref<Expr> kleeAddressExpr, uint64_t sizeI
 #endif
 }
 
+/// Like AddressSpace::findObject, but also creates lazy RAM pages
+bool S2EExecutionState::findKleeObject(uint64_t address, unsigned size, ObjectStateConstPtr &os, bool &inBounds) {
+    if (addressSpace.findObject(address, size, os, inBounds)) {
+        return true;
+    }
+
+    if (!m_asCache.materialize(address & SE_RAM_OBJECT_MASK)) {
+        return false;
+    }
+
+    return addressSpace.findObject(address, size, os, inBounds);
+}
+
 /*
  * Write bytes to a given KLEE address.
  * Assumes that only one memory object is involved and that
@@ -453,7 +493,7 @@ void S2EExecutionState::kleeWriteMemory(ref<Expr> kleeAddressExpr, /* Address */
     ref<klee::ConstantExpr> address = cast<klee::ConstantExpr>(kleeAddressExpr);
 #ifdef CONFIG_SYMBEX_MP
     bool inBounds;
-    if (!addressSpace.findObject(address->getZExtValue(), bytes.size(), os, inBounds)) {
+    if (!findKleeObject(address->getZExtValue(), bytes.size(), os, inBounds)) {
         pabort("kleeWriteMemory: out of bounds / multiple resolution unhandled");
     }
 
@@ -620,6 +660,10 @@ bool S2EExecutionState::merge(const ExecutionState &_b) {
         }
     }
 
+    // Merging replaces the constraints and the concolic assignment
+    ++m_concolicsVersion;
+    m_concretizationCache.invalidate();
+
     return true;
 }
 
@@ -679,6 +723,78 @@ bool S2EExecutionState::testConstraints(const std::vector<ref<Expr>> &c, Constra
 
 /***/
 
+ref<klee::ConstantExpr> S2EExecutionState::toConstant(ref<Expr> e, const std::string &reason) {
+    if (isa<klee::ConstantExpr>(e)) {
+        return cast<klee::ConstantExpr>(e);
+    }
+
+    // A silent concretization of the same expression must still add the constraint
+    uint64_t version = getConcolicsVersion();
+    auto entry = m_concretizationCache.get(e, version);
+    if (entry && entry->constrained) {
+        return entry->value;
+    }
+
+    // The value comes from the concolic assignment, so the added constraint does not change it
+    auto value = ExecutionState::toConstant(e, reason);
+    m_concretizationCache.put(e, version, value, true);
+    return value;
+}
+
+ref<klee::ConstantExpr> S2EExecutionState::toConstantSilent(ref<Expr> e) {
+    if (isa<klee::ConstantExpr>(e)) {
+        return cast<klee::ConstantExpr>(e);
+    }
+
+    uint64_t version = getConcolicsVersion();
+    auto entry = m_concretizationCache.get(e, version);
+    if (entry) {
+        return entry->value;
+    }
+
+    auto value = ExecutionState::toConstantSilent(e);
+    m_concretizationCache.put(e, version, value, false);
+    return value;
+}
+
+void S2EExecutionState::concretizeBytes(const std::vector<ref<Expr>> &bytes, uint8_t *result,
+                                        const std::string &reason, bool silent) {
+#ifdef CONFIG_SYMBEX_MP
+    // The concolic assignment is a model of the current constraints, use it for all bytes
+    ref<Expr> condition = ConstantExpr::create(1, Expr::Bool);
+    unsigned symbolicCount = 0;
+
+    for (unsigned i = 0; i < bytes.size(); ++i) {
+        assert(bytes[i]->getWidth() == Expr::Int8);
+        ref<klee::ConstantExpr> value = dyn_cast<klee::ConstantExpr>(bytes[i]);
+        if (value.isNull()) {
+            value = dyn_cast<klee::ConstantExpr>(concolics->evaluate(bytes[i]));
+            assert(!value.isNull() && "Concolic assignment must be complete");
+            condition = AndExpr::create(condition, EqExpr::create(bytes[i], value));
+            ++symbolicCount;
+        }
+        result[i] = value->getZExtValue();
+    }
+
+    if (silent || !symbolicCount) {
+        return;
+    }
+
+    if (DebugConstraints) {
+        g_s2e->getDebugStream(this) << "Concretizing " << symbolicCount << " bytes (" << reason << ")\n";
+    }
+
+    // The condition holds under the concolic assignment, which therefore stays valid
+    if (!ExecutionState::addConstraint(condition)) {
+        pabort("Could not add bulk concretization constraint");
+    }
+#else
+    for (unsigned i = 0; i < bytes.size(); ++i) {
+        result[i] = cast<klee::ConstantExpr>(bytes[i])->getZExtValue();
+    }
+#endif
+}
+
 uint64_t S2EExecutionState::concretize(klee::ref<klee::Expr> expression, const std::string &reason, bool silent) {
 #ifdef CONFIG_SYMBEX_MP
     if (silent) {
@@ -697,12 +813,15 @@ void S2EExecutionState::addressSpaceChange(const klee::ObjectKey &key, const kle
                                            const klee::ObjectStatePtr &newState) {
     if (oldState && oldState->isMemoryPage()) {
         const auto &mo = oldState->getKey();
-        assert(newState->isMemoryPage());
+        // newState is null when the page gets unbound
+        assert(!newState || newState->isMemoryPage());
         if ((mo.address & ~SE_RAM_OBJECT_MASK) == 0) {
             m_asCache.invalidate(mo.address & SE_RAM_OBJECT_MASK);
             m_tlb.addressSpaceChangeUpdateTlb(oldState, newState);
 #ifdef SE_ENABLE_PHYSRAM_TLB
-            m_tlb.updateRamTlb(oldState, newState);
+            if (newState) {
+                m_tlb.updateRamTlb(oldState, newState);
+            }
 #endif
         }
     } else {
@@ -723,6 +842,13 @@ void S2EExecutionState::addressSpaceSymbolicStatusChange(const ObjectStatePtr &o
 
     auto obj = m_asCache.getBaseObject(object);
     m_tlb.updateTlb(obj, obj);
+
+    if (becameConcrete && object->getSize() != SE_RAM_OBJECT_SIZE) {
+        auto page = object->getAddress() - object->getStoreOffset();
+        if (m_splitPages.count(page)) {
+            m_coalescingCandidates.insert(page);
+        }
+    }
 }
 
 void S2EExecutionState::addressSpaceObjectSplit(const ObjectStateConstPtr &oldObject,
@@ -730,6 +856,211 @@ void S2EExecutionState::addressSpaceObjectSplit(const ObjectStateConstPtr &oldOb
     // Splitting can only happen to RAM
     auto baseObject = m_asCache.notifySplit(oldObject, newObjects);
     m_tlb.updateTlb(oldObject, baseObject);
+
+    if (m_splitPages.insert(oldObject->getAddress()).second) {
+        ++s_liveSplitPages;
+        ++stats::splitRamObjects;
+    }
+}
+
+bool S2EExecutionState::coalescePage(uint64_t pageAddress) {
+    auto base = addressSpace.findObject(pageAddress);
+    if (!base || base->getSize() == SE_RAM_OBJECT_SIZE) {
+        // The page was replaced behind our back, nothing to merge
+        if (m_splitPages.erase(pageAddress)) {
+            --s_liveSplitPages;
+        }
+        return false;
+    }
+
+    std::vector<ObjectStateConstPtr> subObjects;
+    for (unsigned offset = 0; offset < SE_RAM_OBJECT_SIZE; offset += base->getSize()) {
+        auto os = offset ? addressSpace.findObject(pageAddress + offset) : base;
+        assert(os && os->getStoreOffset() == offset);
+        if (!os->isAllConcrete()) {
+            return false;
+        }
+        subObjects.push_back(os);
+    }
+
+    auto merged = ObjectState::allocate(pageAddress, SE_RAM_OBJECT_SIZE, false);
+    uint8_t *store = merged->getConcreteBuffer();
+    for (auto &os : subObjects) {
+        for (unsigned i = 0; i < os->getSize(); ++i) {
+            os->readConcrete8(i, &store[os->getStoreOffset() + i]);
+        }
+        addressSpace.unbindObject(os->getKey());
+    }
+
+    merged->setMemoryPage(true);
+    merged->setSplittable(true);
+    merged->setNotifyOnConcretenessChange(true);
+    addressSpace.bindObject(merged);
+
+    m_asCache.invalidate(pageAddress);
+    m_tlb.updateTlb(base, merged);
+#ifdef SE_ENABLE_PHYSRAM_TLB
+    m_tlb.updateRamTlb(base, merged);
+#endif
+
+    m_splitPages.erase(pageAddress);
+    --s_liveSplitPages;
+    ++stats::coalescedRamObjects;
+    return true;
+}
+
+unsigned S2EExecutionState::coalesceSplitPages() {
+    unsigned count = 0;
+    for (auto page : m_coalescingCandidates) {
+        if (coalescePage(page)) {
+            ++count;
+        }
+    }
+
+    m_coalescingCandidates.clear();
+    return count;
+}
+
+unsigned S2EExecutionState::compressRam(const std::vector<std::pair<uint64_t, uint64_t>> &regions,
+                                        unsigned &budget) {
+    assert(!m_active);
+
+    unsigned count = 0;
+    for (; m_compressRegion < regions.size(); ++m_compressRegion, m_compressOffset = 0) {
+        auto &region = regions[m_compressRegion];
+        for (; m_compressOffset < region.second; m_compressOffset += SE_RAM_OBJECT_SIZE) {
+            if (!budget) {
+                return count;
+            }
+            --budget;
+
+            uint64_t page = region.first + m_compressOffset;
+            auto os = addressSpace.findObject(page);
+            if (!os || m_tlb.references(os)) {
+                continue;
+            }
+
+            if (m_asCache.compress(page)) {
+                ++count;
+            }
+        }
+    }
+
+    // Idle states without any compressible page are retried later
+    m_compressRegion = 0;
+    m_compressOffset = 0;
+    m_ramCompressed = m_asCache.hasCompressedPages();
+    return count;
+}
+
+void S2EExecutionState::decompressRam() {
+    // Pages compressed by a pass that did not complete must be restored too
+    if (m_asCache.hasCompressedPages()) {
+        m_asCache.decompressAll();
+    }
+
+    loadMachineState();
+
+    m_ramCompressed = false;
+    m_compressRegion = 0;
+    m_compressOffset = 0;
+}
+
+bool S2EExecutionState::spillMachineState(const std::string &path) {
+    assert(!m_active && m_stateFile.empty());
+
+    std::vector<std::pair<const Plugin *, std::string>> serialized;
+    for (auto &it : m_PluginState) {
+        std::ostringstream ss;
+        if (it.second->serialize(ss)) {
+            serialized.push_back(std::make_pair(it.first, ss.str()));
+        }
+    }
+
+    const auto &regs = S2EExecutionStateRegisters::getConcreteRegs();
+    const uint8_t *deviceState = m_deviceState.getStateBuffer();
+    uint64_t deviceStateSize = deviceState ? m_deviceState.getStateBufferSize() : 0;
+
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    file.write((const char *) m_registers.getSavedConcreteState(), regs.size);
+    file.write((const char *) deviceState, deviceStateSize);
+
+    std::vector<SpilledPluginState> spilled;
+    uint64_t offset = regs.size + deviceStateSize;
+    for (auto &it : serialized) {
+        file.write(it.second.data(), it.second.size());
+        spilled.push_back(SpilledPluginState{it.first, offset, it.second.size()});
+        offset += it.second.size();
+    }
+    file.close();
+
+    if (!file) {
+        // The plugin states already released their data, give it back
+        unlink(path.c_str());
+        for (auto &it : serialized) {
+            std::istringstream ss(it.second);
+            m_PluginState[it.first]->deserialize(ss);
+        }
+        return false;
+    }
+
+    m_registers.releaseConcreteState(addressSpace);
+    m_deviceState.releaseBuffer();
+
+    m_spilledPluginStates = std::move(spilled);
+    m_spilledDeviceStateSize = deviceStateSize;
+    m_stateFile = path;
+    return true;
+}
+
+void S2EExecutionState::loadMachineState() {
+    if (m_stateFile.empty()) {
+        return;
+    }
+
+    const auto &regs = S2EExecutionStateRegisters::getConcreteRegs();
+    std::vector<uint8_t> data(regs.size + m_spilledDeviceStateSize);
+
+    std::ifstream file(m_stateFile.c_str(), std::ios::binary);
+    file.read((char *) data.data(), data.size());
+    if (!file) {
+        g_s2e->getWarningsStream(this) << "Could not read the state back from " << m_stateFile << '\n';
+        exit(-1);
+    }
+
+    // The previous object was unbound by spillMachineState
+    g_s2e->getExecutor()->registerSharedExternalObject(this, (void *) regs.address, regs.size);
+    m_registers.reloadConcreteState(addressSpace, data.data());
+
+    if (m_spilledDeviceStateSize) {
+        m_deviceState.putBuffer(data.data() + regs.size, 0, m_spilledDeviceStateSize);
+    }
+
+    for (auto &s : m_spilledPluginStates) {
+        std::string pluginData(s.size, '\0');
+        file.seekg(s.offset);
+        file.read(&pluginData[0], s.size);
+        if (!file) {
+            g_s2e->getWarningsStream(this) << "Could not read plugin states back from " << m_stateFile << '\n';
+            exit(-1);
+        }
+
+        std::istringstream ss(pluginData);
+        m_PluginState[s.plugin]->deserialize(ss);
+    }
+
+    m_spilledPluginStates.clear();
+    m_spilledDeviceStateSize = 0;
+    unlink(m_stateFile.c_str());
+    m_stateFile.clear();
+}
+
+uint64_t S2EExecutionState::getIdleTime() const {
+    if (m_active) {
+        return 0;
+    }
+
+    return llvm::sys::TimeValue::now().seconds() - m_lastActiveTime;
 }
 
 uint64_t S2EExecutionState::readMemIoVaddr(bool masked) {
@@ -920,16 +1251,39 @@ void se_write_dirty_mask(uint64_t host_address, uint8_t val) {
 
 static inline CPUTLBRAMEntry *s2e_get_ram_tlb_entry(uint64_t host_address) {
 #if defined(SE_ENABLE_PHYSRAM_TLB)
-    uintptr_t tlb_index = (host_address >> 12) & (CPU_TLB_SIZE - 1);
-    CPUX86State *env = g_s2e_state->regs()->getCpuState();
-    return &env->se_ram_tlb[tlb_index];
+    return g_s2e_state->getTlb()->getRamTlbEntry(host_address);
 #else
     return nullptr;
 #endif
 }
 
 #ifdef SE_ENABLE_PHYSRAM_TLB
-static inline void s2e_dma_rw(uint64_t hostAddress, uint8_t *buf, unsigned size, bool is_write) {
+/// Resolve all the pages of a transfer before copying anything, so that
+/// the copy itself hits the RAM TLB instead of populating it page by page.
+/// Consecutive pages go to distinct sets of the RAM TLB up to this count,
+/// prefetching more would evict the entries that were just filled.
+static const unsigned DMA_PREFETCH_MAX_PAGES = CPU_TLB_SIZE / S2E_RAM_TLB_WAYS;
+
+static void s2e_dma_prefetch(uint64_t hostAddress, unsigned size) {
+    if (!size) {
+        return;
+    }
+
+    uint64_t firstPage = hostAddress & SE_RAM_OBJECT_MASK;
+    uint64_t lastPage = (hostAddress + size - 1) & SE_RAM_OBJECT_MASK;
+    if (((lastPage - firstPage) >> SE_RAM_OBJECT_BITS) >= DMA_PREFETCH_MAX_PAGES) {
+        lastPage = firstPage + (uint64_t) (DMA_PREFETCH_MAX_PAGES - 1) * SE_RAM_OBJECT_SIZE;
+    }
+
+    for (uint64_t hostPage = firstPage; hostPage <= lastPage; hostPage += SE_RAM_OBJECT_SIZE) {
+        CPUTLBRAMEntry *te = s2e_get_ram_tlb_entry(hostPage);
+        if ((te->host_page & ~TLB_NOT_OURS) != hostPage) {
+            g_s2e_state->mem()->fillRamTlb(te, hostPage);
+        }
+    }
+}
+
+static void s2e_dma_transfer(uint64_t hostAddress, uint8_t *buf, unsigned size, bool is_write) {
     while (size > 0) {
         uint64_t hostPage = hostAddress & SE_RAM_OBJECT_MASK;
         uint64_t length = (hostPage + SE_RAM_OBJECT_SIZE) - hostAddress;
@@ -939,7 +1293,10 @@ static inline void s2e_dma_rw(uint64_t hostAddress, uint8_t *buf, unsigned size,
 
         CPUTLBRAMEntry *te = s2e_get_ram_tlb_entry(hostAddress);
 
-        if (te->host_page == hostPage) {
+        // Reading does not require the page to be owned by the state
+        uintptr_t tag = is_write ? te->host_page : te->host_page & ~TLB_NOT_OURS;
+
+        if (tag == hostPage) {
             if (is_write) {
                 klee::ObjectStateConstPtr os = static_cast<const klee::ObjectState *>(te->object_state);
                 os = g_s2e_state->addressSpace.getWriteable(os);
@@ -953,9 +1310,9 @@ static inline void s2e_dma_rw(uint64_t hostAddress, uint8_t *buf, unsigned size,
                 memcpy(buf, ptr, length);
             }
         } else {
-            // Populate the TLB with a 1-byte transfer
-            g_s2e_state->mem()->transferRam(te, hostAddress, buf, 1, is_write, false, false);
-            length = 1;
+            // Symbolic, split, or not yet owned page. Transfer the whole
+            // chunk at once, so that symbolic bytes get concretized together.
+            g_s2e_state->mem()->transferRam(te, hostAddress, buf, length, is_write, false, false);
         }
 
         buf = (uint8_t *) buf + length;
@@ -963,6 +1320,18 @@ static inline void s2e_dma_rw(uint64_t hostAddress, uint8_t *buf, unsigned size,
         size -= length;
     }
 }
+
+static inline void s2e_dma_rw(uint64_t hostAddress, uint8_t *buf, unsigned size, bool is_write) {
+    s2e_dma_prefetch(hostAddress, size);
+    s2e_dma_transfer(hostAddress, buf, size, is_write);
+}
+
+static void s2e_dma_rw_sg(const struct s2e_dma_segment *segments, unsigned count, bool is_write) {
+    // Resolving all the segments first would let them evict each other
+    for (unsigned i = 0; i < count; ++i) {
+        s2e_dma_rw(segments[i].host_address, segments[i].buf, segments[i].size, is_write);
+    }
+}
 #endif
 
 void s2e_dma_read(uint64_t hostAddress, uint8_t *buf, unsigned size) {
@@ -981,6 +1350,26 @@ void s2e_dma_write(uint64_t hostAddress, uint8_t *buf, unsigned size) {
 #endif
 }
 
+void s2e_dma_read_sg(const struct s2e_dma_segment *segments, unsigned count) {
+#if defined(SE_ENABLE_PHYSRAM_TLB)
+    s2e_dma_rw_sg(segments, count, false);
+#else
+    for (unsigned i = 0; i < count; ++i) {
+        g_s2e_state->mem()->read(segments[i].host_address, segments[i].buf, segments[i].size, s2e::HostAddress);
+    }
+#endif
+}
+
+void s2e_dma_write_sg(const struct s2e_dma_segment *segments, unsigned count) {
+#if defined(SE_ENABLE_PHYSRAM_TLB)
+    s2e_dma_rw_sg(segments, count, true);
+#else
+    for (unsigned i = 0; i < count; ++i) {
+        g_s2e_state->mem()->write(segments[i].host_address, segments[i].buf, segments[i].size, s2e::HostAddress);
+    }
+#endif
+}
+
 void s2e_read_ram_concrete_check(uint64_t host_address, uint8_t *buf, uint64_t size) {
     assert(g_s2e_state->isRunningConcrete());
     CPUTLBRAMEntry *re = s2e_get_ram_tlb_entry(host_address);
@@ -9,11 +9,14 @@
 #include <s2e/cpu.h>
 
 #include <s2e/S2EExecutionStateMemory.h>
+#include <s2e/S2EStatsTracker.h>
 
 // Undefine cat from "compiler.h"
 #undef cat
 #include <llvm/Support/CommandLine.h>
 
+#include <algorithm>
+
 extern llvm::cl::opt<bool> PrintModeSwitch;
 using namespace klee;
 
@@ -21,23 +24,72 @@ namespace s2e {
 
 ObjectKey S2EExecutionStateMemory::s_dirtyMask;
 
+namespace {
+
+///
+/// \brief Walks the subobjects of a split page
+///
+/// All subobjects of a page have the same size, so the first one that
+/// is touched by an access can be located without looking up the others.
+///
+class SubObjectIterator {
+    klee::AddressSpace *m_addressSpace;
+    klee::ObjectStateConstPtr m_object;
+    uint64_t m_address;
+    uint64_t m_offset;
+
+public:
+    SubObjectIterator(klee::AddressSpace *addressSpace, const klee::ObjectStateConstPtr &baseObject,
+                      uint64_t pageOffset)
+        : m_addressSpace(addressSpace) {
+        uint64_t subObjectSize = baseObject->getSize();
+        uint64_t firstOffset = pageOffset - (pageOffset % subObjectSize);
+
+        m_address = baseObject->getAddress() + firstOffset;
+        m_offset = pageOffset - firstOffset;
+        m_object = firstOffset ? m_addressSpace->findObject(m_address) : baseObject;
+        assert(m_object && m_object->getSize() == subObjectSize);
+    }
+
+    const klee::ObjectStateConstPtr &get() const {
+        return m_object;
+    }
+
+    /// Offset of the access in the current subobject
+    uint64_t offset() const {
+        return m_offset;
+    }
+
+    void next() {
+        m_address += m_object->getSize();
+        m_offset = 0;
+        m_object = m_addressSpace->findObject(m_address);
+        assert(m_object);
+    }
+};
+
+}
+
 S2EExecutionStateMemory::S2EExecutionStateMemory()
     : m_dirtyMask(nullptr), m_active(nullptr), m_asCache(nullptr), m_addressSpace(nullptr), m_notification(nullptr),
-      m_concretizer(nullptr) {
+      m_concretizer(nullptr), m_bulkConcretizer(nullptr) {
+    flushHostAddressCache();
 }
 
 void S2EExecutionStateMemory::initialize(klee::AddressSpace *addressSpace, AddressSpaceCache *asCache,
                                          const bool *active, klee::IAddressSpaceNotification *notification,
-                                         klee::IConcretizer *concretizer, const klee::ObjectStatePtr &dirtyMask) {
+                                         klee::IConcretizer *concretizer, IBulkConcretizer *bulkConcretizer,
+                                         const klee::ObjectStatePtr &dirtyMask) {
     assert(!s_dirtyMask.address);
     s_dirtyMask = dirtyMask->getKey();
     dirtyMask->setName("DirtyMask");
 
-    update(addressSpace, asCache, active, notification, concretizer);
+    update(addressSpace, asCache, active, notification, concretizer, bulkConcretizer);
 }
 
 void S2EExecutionStateMemory::update(klee::AddressSpace *addressSpace, AddressSpaceCache *asCache, const bool *active,
-                                     klee::IAddressSpaceNotification *notification, klee::IConcretizer *concretizer) {
+                                     klee::IAddressSpaceNotification *notification, klee::IConcretizer *concretizer,
+                                     IBulkConcretizer *bulkConcretizer) {
     auto dirtyMaskObject = addressSpace->findObject(s_dirtyMask.address);
     m_dirtyMask = addressSpace->getWriteable(dirtyMaskObject);
 
@@ -45,6 +97,7 @@ void S2EExecutionStateMemory::update(klee::AddressSpace *addressSpace, AddressSp
     m_asCache = asCache;
     m_notification = notification;
     m_concretizer = concretizer;
+    m_bulkConcretizer = bulkConcretizer;
     m_active = active;
 }
 
@@ -60,10 +113,36 @@ uint64_t S2EExecutionStateMemory::getPhysicalAddress(uint64_t virtualAddress) co
     return physicalAddress | (virtualAddress & ~TARGET_PAGE_MASK);
 }
 
+void S2EExecutionStateMemory::flushHostAddressCache() {
+    for (unsigned i = 0; i < HOST_ADDRESS_CACHE_SIZE; ++i) {
+        m_hostAddressCache[i].virtualPage = (uint64_t) -1;
+    }
+}
+
+void S2EExecutionStateMemory::flushHostAddressCachePage(unsigned tlbIndex) {
+    static_assert(CPU_TLB_SIZE >= HOST_ADDRESS_CACHE_SIZE, "Cache must not be larger than the CPU TLB");
+    m_hostAddressCache[tlbIndex & (HOST_ADDRESS_CACHE_SIZE - 1)].virtualPage = (uint64_t) -1;
+}
+
 uint64_t S2EExecutionStateMemory::getHostAddress(uint64_t address, AddressType addressType) const {
     if (addressType != HostAddress) {
+        uint64_t virtualPage = address & TARGET_PAGE_MASK;
+        HostAddressCacheEntry *entry = nullptr;
+
+        if (addressType == VirtualAddress) {
+            // The cache is only valid for the page tables of the running state
+            assert(*m_active && "Can not translate virtual addresses when the state is not active");
+
+            entry = &m_hostAddressCache[(address >> TARGET_PAGE_BITS) & (HOST_ADDRESS_CACHE_SIZE - 1)];
+            if (entry->virtualPage == virtualPage && entry->pageDir == env->cr[3]) {
+                ++stats::hostAddressCacheHits;
+                return entry->hostPage | (address & ~TARGET_PAGE_MASK);
+            }
+            ++stats::hostAddressCacheMisses;
+        }
+
         // XXX: fix this variable name
-        uint64_t hostAddress = address & TARGET_PAGE_MASK;
+        uint64_t hostAddress = virtualPage;
         if (addressType == VirtualAddress) {
             hostAddress = getPhysicalAddress(hostAddress);
             if (hostAddress == (uint64_t) -1)
@@ -75,6 +154,12 @@ uint64_t S2EExecutionStateMemory::getHostAddress(uint64_t address, AddressType a
         if (!hostAddress)
             return (uint64_t) -1;
 
+        if (entry) {
+            entry->pageDir = env->cr[3];
+            entry->virtualPage = virtualPage;
+            entry->hostPage = hostAddress;
+        }
+
         return hostAddress | (address & ~TARGET_PAGE_MASK);
 
     } else {
@@ -88,6 +173,15 @@ ref<Expr> S2EExecutionStateMemory::read(uint64_t address, Expr::Width width, Add
     assert(width == 1 || (width & 7) == 0);
     uint64_t size = Expr::getMinBytesForWidth(width);
 
+#ifdef CONFIG_SYMBEX_MP
+    if (width >= Expr::Int8 && *m_active) {
+        ref<Expr> res = readObject(address, width, addressType);
+        if (!res.isNull()) {
+            return res;
+        }
+    }
+#endif
+
     /* Access spawns multiple MemoryObject's */
     ref<Expr> res(0);
     for (unsigned i = 0; i != size; ++i) {
@@ -100,6 +194,101 @@ ref<Expr> S2EExecutionStateMemory::read(uint64_t address, Expr::Width width, Add
     return res;
 }
 
+ref<Expr> S2EExecutionStateMemory::readObject(uint64_t address, Expr::Width width, AddressType addressType) {
+    uint64_t size = Expr::getMinBytesForWidth(width);
+    uint64_t hostAddress = getHostAddress(address, addressType);
+    if (hostAddress == (uint64_t) -1) {
+        return ref<Expr>(0);
+    }
+
+    uint64_t pageOffset = hostAddress & ~SE_RAM_OBJECT_MASK;
+    if (pageOffset + size > SE_RAM_OBJECT_SIZE) {
+        return ref<Expr>(0);
+    }
+
+    auto os = m_asCache->find(hostAddress & SE_RAM_OBJECT_MASK);
+    if (!os) {
+        assert(AddressSpaceCache::isLazyPage(hostAddress & SE_RAM_OBJECT_MASK));
+        return ConstantExpr::create(0, width);
+    }
+
+    // Split pages are made of several objects
+    if (os->getBitArraySize() != os->getSize()) {
+        return ref<Expr>(0);
+    }
+
+    const uint8_t *concreteData = nullptr;
+    if (os->isSharedConcrete()) {
+        concreteData = (const uint8_t *) os->getAddress() + pageOffset;
+    } else if (os->isConcrete(pageOffset, width)) {
+        // The store is only returned by default when all bytes are concrete
+        concreteData = os->getConcreteBuffer(true) + pageOffset;
+    }
+
+    if (concreteData && width <= Expr::Int64) {
+        bool littleEndian = Context::get().isLittleEndian();
+        uint64_t value = 0;
+        for (unsigned i = 0; i < size; ++i) {
+            unsigned idx = littleEndian ? i : (size - i - 1);
+            value |= (uint64_t) concreteData[idx] << (i * 8);
+        }
+        return ConstantExpr::create(value, width);
+    }
+
+    // ConcatExpr::create merges adjacent extracts, so a value stored
+    // by a wide write is read back as the original expression
+    return os->read(pageOffset, width);
+}
+
+const uint8_t *S2EExecutionStateMemory::getConcreteSpan(uint64_t address, uint64_t size, uint64_t *length,
+                                                       AddressType addressType) {
+    *length = 0;
+
+#ifdef CONFIG_SYMBEX_MP
+    if (!*m_active) {
+        return nullptr;
+    }
+
+    uint64_t hostAddress = getHostAddress(address, addressType);
+    if (hostAddress == (uint64_t) -1) {
+        return nullptr;
+    }
+
+    uint64_t pageOffset = hostAddress & ~SE_RAM_OBJECT_MASK;
+    uint64_t spanLength = std::min(size, (uint64_t) SE_RAM_OBJECT_SIZE - pageOffset);
+
+    auto os = m_asCache->find(hostAddress & SE_RAM_OBJECT_MASK);
+    if (!os) {
+        assert(AddressSpaceCache::isLazyPage(hostAddress & SE_RAM_OBJECT_MASK));
+        *length = spanLength;
+        return AddressSpaceCache::getZeroPage() + pageOffset;
+    }
+
+    if (os->isSharedConcrete()) {
+        *length = spanLength;
+        return (const uint8_t *) os->getAddress() + pageOffset;
+    }
+
+    if (os->getBitArraySize() != os->getSize()) {
+        return nullptr;
+    }
+
+    if (!os->isAllConcrete()) {
+        for (uint64_t i = 0; i < spanLength; ++i) {
+            if (!os->isConcrete(pageOffset + i, Expr::Int8)) {
+                spanLength = i;
+                break;
+            }
+        }
+    }
+
+    *length = spanLength;
+    return spanLength ? os->getConcreteBuffer(true) + pageOffset : nullptr;
+#else
+    return nullptr;
+#endif
+}
+
 ref<Expr> S2EExecutionStateMemory::readMemory8(uint64_t address, AddressType addressType) {
     uint64_t hostAddress = getHostAddress(address, addressType);
     if (hostAddress == (uint64_t) -1)
@@ -213,7 +402,11 @@ bool S2EExecutionStateMemory::write(uint64_t address, const void *buf, uint64_t
 klee::ObjectStateConstPtr S2EExecutionStateMemory::getMemoryObject(uint64_t address, AddressType addressType) const {
     uint64_t hostAddr = getHostAddress(address, addressType);
     uint64_t pageAddr = hostAddr & SE_RAM_OBJECT_MASK;
-    return m_addressSpace->findObject(pageAddr);
+    auto os = m_addressSpace->findObject(pageAddr);
+    if (!os) {
+        os = m_asCache->materialize(pageAddr);
+    }
+    return os;
 }
 
 const void *S2EExecutionStateMemory::getConcreteBuffer(uint64_t address, AddressType addressType) const {
@@ -239,21 +432,35 @@ bool S2EExecutionStateMemory::symbolic(uint64_t address, uint64_t size, AddressT
         }
 
         uint64_t pageAddr = hostAddress & SE_RAM_OBJECT_MASK;
-        auto os = m_asCache->get(pageAddr);
-        assert(os);
+        auto os = m_asCache->find(pageAddr);
+        assert(os || AddressSpaceCache::isLazyPage(pageAddr));
 
-        uint64_t pageOffset = address % os->getSize();
-        uint64_t pageLength = os->getSize() - pageOffset;
+        uint64_t pageOffset = hostAddress & ~SE_RAM_OBJECT_MASK;
+        uint64_t pageLength = SE_RAM_OBJECT_SIZE - pageOffset;
 
         if (pageLength > size) {
             pageLength = size;
         }
 
-        if (!os->isAllConcrete()) {
-            for (unsigned i = 0; i < pageLength; ++i) {
-                if (!os->isConcrete(pageOffset + i, klee::Expr::Int8)) {
-                    return true;
+        // Untouched lazy pages only contain zeros
+        if (os) {
+            SubObjectIterator it(m_addressSpace, os, pageOffset);
+            uint64_t remaining = pageLength;
+            while (true) {
+                uint64_t length = std::min(it.get()->getSize() - it.offset(), remaining);
+                if (!it.get()->isAllConcrete()) {
+                    for (uint64_t i = 0; i < length; ++i) {
+                        if (!it.get()->isConcrete(it.offset() + i, klee::Expr::Int8)) {
+                            return true;
+                        }
+                    }
+                }
+
+                remaining -= length;
+                if (!remaining) {
+                    break;
                 }
+                it.next();
             }
         }
 
@@ -264,6 +471,38 @@ bool S2EExecutionStateMemory::symbolic(uint64_t address, uint64_t size, AddressT
     return false;
 }
 
+bool S2EExecutionStateMemory::concretize(uint64_t address, uint64_t size, AddressType addressType) {
+#ifdef CONFIG_SYMBEX_MP
+    if (!symbolic(address, size, addressType)) {
+        return true;
+    }
+
+    std::vector<ref<Expr>> bytes(size);
+    uint64_t offset = 0;
+    while (offset < size) {
+        uint64_t hostAddress = getHostAddress(address + offset, addressType);
+        if (hostAddress == (uint64_t) -1) {
+            return false;
+        }
+
+        uint64_t hostPage = hostAddress & SE_RAM_OBJECT_MASK;
+        uint64_t length = (hostPage + SE_RAM_OBJECT_SIZE) - hostAddress;
+        if (length > size - offset) {
+            length = size - offset;
+        }
+
+        transferRam(nullptr, hostAddress, &bytes[offset], length, false, false, true);
+        offset += length;
+    }
+
+    std::vector<uint8_t> concreteBytes(size);
+    m_bulkConcretizer->concretizeBytes(bytes, concreteBytes.data(), "memory concretization", false);
+    return write(address, concreteBytes.data(), size, addressType);
+#else
+    return true;
+#endif
+}
+
 /***/
 
 void S2EExecutionStateMemory::transferRamInternal(const klee::ObjectStateConstPtr &os_, uint64_t object_offset,
@@ -287,6 +526,12 @@ void S2EExecutionStateMemory::transferRamInternal(const klee::ObjectStateConstPt
         auto wos = m_addressSpace->getWriteable(os);
         bool oldAllConcrete = wos->isAllConcrete();
 
+        if (oldAllConcrete) {
+            // Concrete data stays concrete, this is what the softmmu fast path does too
+            memcpy(wos->getConcreteBuffer() + object_offset, buf, size);
+            return;
+        }
+
         for (uint64_t i = 0; i < size; ++i) {
             wos->write8(object_offset + i, buf[i]);
         }
@@ -297,7 +542,14 @@ void S2EExecutionStateMemory::transferRamInternal(const klee::ObjectStateConstPt
         }
 
     } else {
-        ObjectStatePtr wos = nullptr;
+        if (os->isAllConcrete()) {
+            memcpy(buf, os->getConcreteBuffer() + object_offset, size);
+            return;
+        }
+
+        // Gather all symbolic bytes first in order to concretize them in one go
+        std::vector<uint64_t> symbolicOffsets;
+        std::vector<ref<Expr>> symbolicBytes;
         for (uint64_t i = 0; i < size; ++i) {
             if (!os->readConcrete8(object_offset + i, buf + i)) {
                 if (exitOnSymbolicRead) {
@@ -307,14 +559,32 @@ void S2EExecutionStateMemory::transferRamInternal(const klee::ObjectStateConstPt
                     // fast_longjmp(env->jmp_env, 1);
                 }
 
-                if (!wos) {
-                    os = wos = m_addressSpace->getWriteable(os);
-                }
-
-                buf[i] = m_concretizer->concretize(wos->read8(object_offset + i), "memory access from concrete code");
-                wos->write8(object_offset + i, buf[i]);
+                symbolicOffsets.push_back(i);
+                symbolicBytes.push_back(os->read8(object_offset + i));
             }
         }
+
+        if (symbolicBytes.empty()) {
+            return;
+        }
+
+        std::vector<uint8_t> concreteBytes(symbolicBytes.size());
+        m_bulkConcretizer->concretizeBytes(symbolicBytes, concreteBytes.data(), "memory access from concrete code",
+                                           false);
+
+        auto wos = m_addressSpace->getWriteable(os);
+        bool oldAllConcrete = wos->isAllConcrete();
+
+        for (unsigned i = 0; i < symbolicOffsets.size(); ++i) {
+            uint64_t offset = symbolicOffsets[i];
+            buf[offset] = concreteBytes[i];
+            wos->write8(object_offset + offset, buf[offset]);
+        }
+
+        bool newAllConcrete = wos->isAllConcrete();
+        if ((oldAllConcrete != newAllConcrete) && (wos->notifyOnConcretenessChange())) {
+            m_notification->addressSpaceSymbolicStatusChange(wos, newAllConcrete);
+        }
     }
 }
 
@@ -341,6 +611,59 @@ void S2EExecutionStateMemory::transferRamInternalSymbolic(const klee::ObjectStat
     }
 }
 
+void S2EExecutionStateMemory::fillRamTlbEntry(struct CPUTLBRAMEntry *te, const klee::ObjectStateConstPtr &os) {
+    if (!os->isSharedConcrete() && os->isAllConcrete()) {
+        /* The object state pointer will be automatically updated if it becomes writable */
+        // XXX: do proper reference counting
+        te->object_state = (void *) os.get();
+        te->host_page = os->getAddress();
+        te->addend = (uintptr_t) os->getConcreteBufferPtr()->get() - os->getAddress();
+        if (!m_asCache->isOwnedByUs(os)) {
+            te->host_page |= TLB_NOT_OURS;
+        }
+    }
+}
+
+bool S2EExecutionStateMemory::transferZeroPage(void *buf, uint64_t size, bool isWrite, bool isSymbolic) {
+    if (isSymbolic) {
+        ref<Expr> *exprs = static_cast<ref<Expr> *>(buf);
+        for (uint64_t i = 0; i < size; ++i) {
+            if (!isWrite) {
+                exprs[i] = ConstantExpr::create(0, Expr::Int8);
+            } else if (!exprs[i]->isZero()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    uint8_t *bytes = static_cast<uint8_t *>(buf);
+    if (!isWrite) {
+        memset(bytes, 0, size);
+        return true;
+    }
+
+    for (uint64_t i = 0; i < size; ++i) {
+        if (bytes[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void S2EExecutionStateMemory::fillRamTlb(struct CPUTLBRAMEntry *te, uint64_t hostAddress) {
+    assert(*m_active);
+    auto os = m_asCache->find(hostAddress & SE_RAM_OBJECT_MASK);
+    if (!os) {
+        // Keep untouched pages on the slow path rather than creating their object
+        return;
+    }
+
+    if (os->getBitArraySize() == os->getSize()) {
+        fillRamTlbEntry(te, os);
+    }
+}
+
 void S2EExecutionStateMemory::transferRam(struct CPUTLBRAMEntry *te, uint64_t hostAddress, void *buf, uint64_t size,
                                           bool isWrite, bool exitOnSymbolicRead, bool isSymbolic) {
     assert(*m_active);
@@ -366,7 +689,15 @@ void S2EExecutionStateMemory::transferRam(struct CPUTLBRAMEntry *te, uint64_t ho
     /* Single-object access */
     uint64_t page_addr = hostAddress & SE_RAM_OBJECT_MASK;
 
-    auto os = m_asCache->get(page_addr);
+    auto os = m_asCache->find(page_addr);
+    if (!os) {
+        if (transferZeroPage(buf, size, isWrite, isSymbolic)) {
+            return;
+        }
+
+        // First write of non-zero data, the page needs its own object now
+        os = m_asCache->get(page_addr);
+    }
     assert(os);
 
     unsigned osSize = os->getBitArraySize();
@@ -375,16 +706,7 @@ void S2EExecutionStateMemory::transferRam(struct CPUTLBRAMEntry *te, uint64_t ho
     if (osSize == os->getSize()) {
         assert(osSize == SE_RAM_OBJECT_SIZE);
         if (te) {
-            if (!os->isSharedConcrete() && os->isAllConcrete()) {
-                /* The object state pointer will be automatically updated if it becomes writable */
-                // XXX: do proper reference counting
-                te->object_state = (void *) os.get();
-                te->host_page = os->getAddress();
-                te->addend = (uintptr_t) os->getConcreteBufferPtr()->get() - os->getAddress();
-                if (!m_asCache->isOwnedByUs(os)) {
-                    te->host_page |= TLB_NOT_OURS;
-                }
-            }
+            fillRamTlbEntry(te, os);
         }
 
         if (isSymbolic) {
@@ -399,31 +721,30 @@ void S2EExecutionStateMemory::transferRam(struct CPUTLBRAMEntry *te, uint64_t ho
     assert(!os->isSharedConcrete());
 
     /* Slower path, fetch every individual object and do the transfer */
-    while (size > 0) {
-        os = m_addressSpace->findObject(page_addr);
-        assert(os);
+    SubObjectIterator it(m_addressSpace, os, page_offset);
+    uint8_t *ptr = static_cast<uint8_t *>(buf);
+    ref<Expr> *exprPtr = static_cast<ref<Expr> *>(buf);
 
-        /* Check that we indeed fall into this page */
-        if (page_offset && os->getSize() <= page_offset) {
-            page_offset -= os->getSize();
-            page_addr += os->getSize();
-            continue;
+    while (size > 0) {
+        os = it.get();
+        uint64_t objectOffset = it.offset();
+        uint64_t transferSize = os->getSize() - objectOffset;
+        if (transferSize > size) {
+            transferSize = size;
         }
 
-        uint64_t transferSize = os->getSize() < size ? os->getSize() : size;
-
         if (isSymbolic) {
-            transferRamInternalSymbolic(os, page_offset, static_cast<ref<Expr> *>(buf), transferSize, isWrite);
+            transferRamInternalSymbolic(os, objectOffset, exprPtr, transferSize, isWrite);
+            exprPtr += transferSize;
         } else {
-            transferRamInternal(os, page_offset, static_cast<uint8_t *>(buf), transferSize, isWrite,
-                                exitOnSymbolicRead);
+            transferRamInternal(os, objectOffset, ptr, transferSize, isWrite, exitOnSymbolicRead);
+            ptr += transferSize;
         }
 
         size -= transferSize;
-
-        // Only the first access can access the middle of an object
-        page_offset = 0;
-        page_addr += transferSize;
+        if (size > 0) {
+            it.next();
+        }
     }
 }
 
@@ -99,6 +99,19 @@ void S2EExecutionStateRegisters::addressSpaceChange(const klee::ObjectKey &key,
     }
 }
 
+void S2EExecutionStateRegisters::releaseConcreteState(klee::AddressSpace &addressSpace) {
+    assert(!*m_active);
+    addressSpace.unbindObject(s_concreteRegs);
+    m_concreteRegs = nullptr;
+}
+
+void S2EExecutionStateRegisters::reloadConcreteState(klee::AddressSpace &addressSpace, const uint8_t *data) {
+    assert(!*m_active);
+    update(addressSpace, nullptr, nullptr, nullptr, nullptr);
+    m_concreteRegs->setName("ConcreteCpuRegisters");
+    memcpy(m_concreteRegs->getConcreteBuffer(), data, s_concreteRegs.size);
+}
+
 bool S2EExecutionStateRegisters::flagsRegistersAreSymbolic() const {
     if (m_symbolicRegs->isAllConcrete())
         return false;
@@ -12,6 +12,7 @@
 #include <s2e/s2e_libcpu.h>
 
 #include <s2e/S2EExecutionStateTlb.h>
+#include <s2e/S2EStatsTracker.h>
 #include <s2e/Utils.h>
 #include <s2e/s2e_config.h>
 
@@ -33,6 +34,140 @@ namespace s2e {
 
 using namespace klee;
 
+static inline unsigned getSlotIndex(unsigned mmu_idx, unsigned index) {
+    return mmu_idx * CPU_TLB_SIZE + index;
+}
+
+S2EExecutionStateTlb::S2EExecutionStateTlb(AddressSpaceCache *ascache, S2EExecutionStateRegisters *regs)
+    : m_slots(NB_MMU_MODES * CPU_TLB_SIZE), m_ownershipGeneration(1), m_trackingGeneration(1), m_tracking(false),
+      m_asCache(ascache), m_registers(regs) {
+#if defined(SE_ENABLE_PHYSRAM_TLB)
+    for (auto &victim : m_ramTlbVictims) {
+        victim = RamTlbEntry();
+    }
+    m_ramTlbNextVictim = 0;
+    m_ramTlbNextWay = 0;
+#endif
+}
+
+void S2EExecutionStateTlb::linkSlot(const klee::ObjectStateConstPtr &objectState, unsigned slot) {
+    TlbSlot &s = m_slots[slot];
+    s.prev = NO_SLOT;
+    s.next = NO_SLOT;
+
+    auto res = m_tlbMap.emplace(objectState, slot);
+    if (!res.second) {
+        s.next = res.first->second;
+        m_slots[s.next].prev = slot;
+        res.first->second = slot;
+    }
+}
+
+void S2EExecutionStateTlb::unlinkSlot(const klee::ObjectStateConstPtr &objectState, unsigned slot) {
+    auto it = m_tlbMap.find(objectState);
+    assert(it != m_tlbMap.end() && "Invalid cache!");
+
+    const TlbSlot &s = m_slots[slot];
+    if (s.next != NO_SLOT) {
+        m_slots[s.next].prev = s.prev;
+    }
+
+    if (s.prev != NO_SLOT) {
+        m_slots[s.prev].next = s.next;
+    } else {
+        assert(it->second == slot && "Invalid cache!");
+        if (s.next == NO_SLOT) {
+#ifdef S2E_DEBUG_TLBCACHE
+            g_s2e->getDebugStream(g_s2e_state) << "unlinkSlot: Erasing cache entry for " << objectState << "\n";
+#endif
+            m_tlbMap.erase(it);
+        } else {
+            it->second = s.next;
+        }
+    }
+}
+
+/**
+ * Give write access to the entry and remember it, so that
+ * clearTlbOwnership only has to visit the entries that need it.
+ */
+void S2EExecutionStateTlb::setOwned(CPUX86State *env, unsigned mmu_idx, unsigned index) {
+    env->tlb_table[mmu_idx][index].addr_write &= ~TLB_NOT_OURS;
+
+    unsigned slot = getSlotIndex(mmu_idx, index);
+    TlbSlot &s = m_slots[slot];
+    if (s.ownershipGeneration != m_ownershipGeneration) {
+        s.ownershipGeneration = m_ownershipGeneration;
+        m_ownedSlots.push_back(slot);
+    }
+}
+
+void S2EExecutionStateTlb::track(unsigned slot) {
+    TlbSlot &s = m_slots[slot];
+    if (s.trackingGeneration != m_trackingGeneration) {
+        s.trackingGeneration = m_trackingGeneration;
+        m_trackedSlots.push_back(slot);
+    }
+}
+
+void S2EExecutionStateTlb::beginTracking() {
+    endTracking();
+    m_tracking = true;
+}
+
+void S2EExecutionStateTlb::endTracking() {
+    m_trackedSlots.clear();
+    ++m_trackingGeneration;
+    m_tracking = false;
+}
+
+unsigned S2EExecutionStateTlb::flushTrackedEntries(CPUX86State *env) {
+    for (auto slot : m_trackedSlots) {
+        unsigned mmu_idx = slot / CPU_TLB_SIZE;
+        unsigned index = slot % CPU_TLB_SIZE;
+        CPUTLBEntry *entry = &env->tlb_table[mmu_idx][index];
+
+        flushTlbCachePage(static_cast<ObjectState *>(entry->objectState), mmu_idx, index);
+        entry->addr_read = -1;
+        entry->addr_write = -1;
+        entry->addr_code = -1;
+    }
+
+    unsigned count = m_trackedSlots.size();
+    endTracking();
+    return count;
+}
+
+unsigned S2EExecutionStateTlb::dropStaleEntries() {
+    CPUX86State *cpu = m_registers->getCpuState();
+
+    // Looking up the pages must not materialize or decompress them,
+    // a page without an object cannot be mapped by the TLB anyway.
+    std::vector<ObjectStateConstPtr> staleObjects;
+    for (auto &it : m_tlbMap) {
+        if (m_asCache->findBound(it.first->getAddress()) != it.first) {
+            staleObjects.push_back(it.first);
+        }
+    }
+
+    unsigned count = 0;
+    for (auto &os : staleObjects) {
+        auto it = m_tlbMap.find(os);
+        for (unsigned slot = it->second; slot != NO_SLOT; slot = m_slots[slot].next) {
+            CPUTLBEntry *entry = &cpu->tlb_table[slot / CPU_TLB_SIZE][slot % CPU_TLB_SIZE];
+            entry->objectState = 0;
+            entry->se_addend = 0;
+            entry->addr_read = -1;
+            entry->addr_write = -1;
+            entry->addr_code = -1;
+            ++count;
+        }
+        m_tlbMap.erase(it);
+    }
+
+    return count;
+}
+
 void S2EExecutionStateTlb::addressSpaceChangeUpdateTlb(const klee::ObjectStateConstPtr &oldState,
                                                        const klee::ObjectStatePtr &newState) {
     if (!(oldState && oldState->isMemoryPage())) {
@@ -51,31 +186,148 @@ void S2EExecutionStateTlb::addressSpaceChangeUpdateTlb(const klee::ObjectStateCo
 }
 
 #if defined(SE_ENABLE_PHYSRAM_TLB)
-void S2EExecutionStateTlb::updateRamTlb(const klee::ObjectStateConstPtr &oldState,
-                                        const klee::ObjectStatePtr &newState) {
+static_assert(CPU_TLB_SIZE % S2E_RAM_TLB_WAYS == 0, "The RAM TLB must hold a whole number of sets");
+
+static const unsigned RAM_TLB_SETS = CPU_TLB_SIZE / S2E_RAM_TLB_WAYS;
+
+/// Returned for pages that cannot be accessed through the RAM TLB
+static CPUTLBRAMEntry s_uncachedRamTlbEntry;
+
+static inline CPUTLBRAMEntry *getRamTlbSet(CPUX86State *env, uint64_t address) {
+    unsigned set = (address >> SE_RAM_OBJECT_BITS) & (RAM_TLB_SETS - 1);
+    return &env->se_ram_tlb[set * S2E_RAM_TLB_WAYS];
+}
+
+template <typename T> static inline bool ramTlbEntryMatches(const T &re, uint64_t page) {
+    return re.object_state && (re.host_page & ~TLB_NOT_OURS) == page;
+}
+
+template <typename T> static inline void clearRamTlbEntry(T &re) {
+    re.host_page = 0;
+    re.addend = 0;
+    re.object_state = nullptr;
+}
+
+template <typename D, typename S> static inline void copyRamTlbEntry(D &dst, const S &src) {
+    dst.host_page = src.host_page;
+    dst.addend = src.addend;
+    dst.object_state = src.object_state;
+}
+
+template <typename T>
+static void updateRamTlbEntry(T &re, const klee::ObjectStateConstPtr &oldState, const klee::ObjectStatePtr &newState,
+                              AddressSpaceCache *asCache) {
+    auto address = oldState->getAddress();
+
+    assert((re.host_page & ~TLB_NOT_OURS) == address);
+    if (newState->isAllConcrete()) {
+        // XXX: use proper ref counting
+        re.object_state = newState.get();
+        re.host_page = address;
+        re.addend = (uintptr_t) newState->getConcreteBufferPtr()->get() - address;
+    }
+    if (asCache->isOwnedByUs(newState)) {
+        re.host_page &= ~TLB_NOT_OURS;
+    }
+}
+
+CPUTLBRAMEntry *S2EExecutionStateTlb::getRamTlbEntry(uint64_t hostAddress) {
     CPUX86State *cpu = m_registers->getCpuState();
-    uintptr_t tlb_index = (oldState->getAddress() >> 12) & (CPU_TLB_SIZE - 1);
-    CPUTLBRAMEntry *re = &cpu->se_ram_tlb[tlb_index];
+    uint64_t page = hostAddress & SE_RAM_OBJECT_MASK;
+    CPUTLBRAMEntry *set = getRamTlbSet(cpu, page);
+    CPUTLBRAMEntry *re = nullptr;
 
+    for (unsigned way = 0; way < S2E_RAM_TLB_WAYS; ++way) {
+        if (ramTlbEntryMatches(set[way], page)) {
+            return &set[way];
+        }
+        if (!re && !set[way].object_state) {
+            re = &set[way];
+        }
+    }
+
+    // Don't evict anything for pages that transferRam would not cache
+    auto os = m_asCache->find(page);
+    if (!os || os->isSharedConcrete() || !os->isAllConcrete() || os->getSize() != os->getBitArraySize()) {
+        clearRamTlbEntry(s_uncachedRamTlbEntry);
+        return &s_uncachedRamTlbEntry;
+    }
+
+    if (!re) {
+        re = &set[m_ramTlbNextWay++ % S2E_RAM_TLB_WAYS];
+    }
+
+    for (auto &victim : m_ramTlbVictims) {
+        if (ramTlbEntryMatches(victim, page)) {
+            RamTlbEntry evicted;
+            copyRamTlbEntry(evicted, *re);
+            copyRamTlbEntry(*re, victim);
+            copyRamTlbEntry(victim, evicted);
+            ++stats::ramTlbVictimHits;
+            return re;
+        }
+    }
+
+    ++stats::ramTlbMisses;
+
+    if (re->object_state) {
+        ++stats::ramTlbConflicts;
+        copyRamTlbEntry(m_ramTlbVictims[m_ramTlbNextVictim++ % S2E_RAM_TLB_VICTIMS], *re);
+    }
+
+    clearRamTlbEntry(*re);
+    return re;
+}
+
+void S2EExecutionStateTlb::updateRamTlb(const klee::ObjectStateConstPtr &oldState,
+                                        const klee::ObjectStatePtr &newState) {
     assert(oldState->isSharedConcrete() == newState->isSharedConcrete());
 
-    auto address = oldState->getAddress();
+    if (oldState->isSharedConcrete()) {
+        return;
+    }
 
-    if (!oldState->isSharedConcrete() && re->object_state == oldState) {
-        assert((re->host_page & ~TLB_NOT_OURS) == address);
-        if (newState->isAllConcrete()) {
-            // XXX: use proper ref counting
-            re->object_state = newState.get();
-            re->host_page = address;
-            re->addend = (uintptr_t) newState->getConcreteBufferPtr()->get() - address;
+    CPUX86State *cpu = m_registers->getCpuState();
+    CPUTLBRAMEntry *set = getRamTlbSet(cpu, oldState->getAddress());
+
+    for (unsigned way = 0; way < S2E_RAM_TLB_WAYS; ++way) {
+        if (set[way].object_state == oldState) {
+            updateRamTlbEntry(set[way], oldState, newState, m_asCache);
         }
-        if (m_asCache->isOwnedByUs(newState)) {
-            re->host_page &= ~TLB_NOT_OURS;
+    }
+
+    for (auto &victim : m_ramTlbVictims) {
+        if (victim.object_state == oldState) {
+            updateRamTlbEntry(victim, oldState, newState, m_asCache);
         }
     }
 }
 #endif
 
+bool S2EExecutionStateTlb::references(const klee::ObjectStateConstPtr &objectState) const {
+    if (m_tlbMap.count(objectState)) {
+        return true;
+    }
+
+#if defined(SE_ENABLE_PHYSRAM_TLB)
+    CPUX86State *cpu = m_registers->getCpuState();
+    const CPUTLBRAMEntry *set = getRamTlbSet(cpu, objectState->getAddress());
+    for (unsigned way = 0; way < S2E_RAM_TLB_WAYS; ++way) {
+        if (set[way].object_state == objectState.get()) {
+            return true;
+        }
+    }
+
+    for (auto &victim : m_ramTlbVictims) {
+        if (victim.object_state == objectState.get()) {
+            return true;
+        }
+    }
+#endif
+
+    return false;
+}
+
 void S2EExecutionStateTlb::updateTlb(const klee::ObjectStateConstPtr &oldState, const klee::ObjectStatePtr &newState) {
 
     CPUX86State *cpu = m_registers->getCpuState();
@@ -94,18 +346,16 @@ void S2EExecutionStateTlb::updateTlb(const klee::ObjectStateConstPtr &oldState,
     assert(oldState->isSharedConcrete() == newState->isSharedConcrete());
 
     auto it = m_tlbMap.find(oldState);
-    bool found = false;
     if (it != m_tlbMap.end()) {
-        found = true;
-        ObjectStateTlbReferences vec = (*it).second;
-        unsigned size = vec.size();
-        assert(size > 0);
-        for (unsigned i = 0; i < size; ++i) {
-            const TlbCoordinates &coords = vec[i];
+        unsigned head = it->second;
+        unsigned tail = NO_SLOT;
+        for (unsigned slot = head; slot != NO_SLOT; slot = m_slots[slot].next) {
+            unsigned mmu_idx = slot / CPU_TLB_SIZE;
+            unsigned index = slot % CPU_TLB_SIZE;
 #ifdef S2E_DEBUG_TLBCACHE
-            g_s2e->getDebugStream() << "    mmu_idx=" << coords.first << " index=" << coords.second << "\n";
+            g_s2e->getDebugStream() << "    mmu_idx=" << mmu_idx << " index=" << index << "\n";
 #endif
-            CPUTLBEntry *entry = &cpu->tlb_table[coords.first][coords.second];
+            CPUTLBEntry *entry = &cpu->tlb_table[mmu_idx][index];
             assert(entry->objectState == (void *) oldState.get());
             assert(newState);
 
@@ -118,16 +368,26 @@ void S2EExecutionStateTlb::updateTlb(const klee::ObjectStateConstPtr &oldState,
                                    (uintptr_t) newState->getConcreteBuffer(true);
 
                 if (m_asCache->isOwnedByUs(newState)) {
-                    entry->addr_write &= ~TLB_NOT_OURS;
+                    setOwned(cpu, mmu_idx, index);
                 }
             }
 
-            updateTlbEntryConcreteStatus(cpu, coords.first, coords.second, newState);
+            updateTlbEntryConcreteStatus(cpu, mmu_idx, index, newState);
+            if (m_tracking) {
+                track(slot);
+            }
+            tail = slot;
         }
 
-        m_tlbMap[newState] = vec;
         if (newState != oldState) {
-            m_tlbMap.erase(oldState);
+            // The chain moves as a whole, the slots themselves stay the same
+            m_tlbMap.erase(it);
+            auto res = m_tlbMap.emplace(newState, head);
+            if (!res.second) {
+                m_slots[tail].next = res.first->second;
+                m_slots[res.first->second].prev = tail;
+                res.first->second = head;
+            }
         }
     }
 
@@ -162,27 +422,7 @@ void S2EExecutionStateTlb::flushTlbCachePage(const klee::ObjectStatePtr &objectS
         return;
     }
 
-    bool found = false;
-    TlbMap::iterator tlbIt = m_tlbMap.find(objectState);
-    assert(tlbIt != m_tlbMap.end());
-
-    ObjectStateTlbReferences &vec = (*tlbIt).second;
-    foreach2 (vit, vec.begin(), vec.end()) {
-        if ((*vit) == std::make_pair((unsigned) mmu_idx, (unsigned) index)) {
-            vec.erase(vit);
-            found = true;
-            break;
-        }
-    }
-
-    assert(found && "Invalid cache!");
-
-    if (vec.empty()) {
-#ifdef S2E_DEBUG_TLBCACHE
-        g_s2e->getDebugStream(g_s2e_state) << "flushTlbCachePage: Erasing cache entry for " << objectState << "\n";
-#endif
-        m_tlbMap.erase(tlbIt);
-    }
+    unlinkSlot(objectState, getSlotIndex(mmu_idx, index));
 }
 
 /**
@@ -204,11 +444,19 @@ void S2EExecutionStateTlb::updateTlbEntryConcreteStatus(struct CPUX86State *env,
     }
 
 #ifdef SE_ENABLE_PHYSRAM_TLB
-    uintptr_t ram_tlb_index = (state->getAddress() >> 12) & (CPU_TLB_SIZE - 1);
-    CPUTLBRAMEntry *re = &env->se_ram_tlb[ram_tlb_index];
-    re->host_page = 0;
-    re->addend = 0;
-    re->object_state = 0;
+    uint64_t page = state->getAddress() & SE_RAM_OBJECT_MASK;
+    CPUTLBRAMEntry *set = getRamTlbSet(env, page);
+    for (unsigned way = 0; way < S2E_RAM_TLB_WAYS; ++way) {
+        if (set[way].object_state == state || ramTlbEntryMatches(set[way], page)) {
+            clearRamTlbEntry(set[way]);
+        }
+    }
+
+    for (auto &victim : m_ramTlbVictims) {
+        if (victim.object_state == state || ramTlbEntryMatches(victim, page)) {
+            clearRamTlbEntry(victim);
+        }
+    }
 #endif
 }
 
@@ -218,17 +466,27 @@ void S2EExecutionStateTlb::clearRamTlb() {
     for (unsigned i = 0; i < CPU_TLB_SIZE; i++) {
         env->se_ram_tlb[i] = nullptrCPUTLBRAMEntry;
     }
+
+    for (auto &victim : m_ramTlbVictims) {
+        clearRamTlbEntry(victim);
+    }
 }
 #endif
 
+/**
+ * Only the entries that were given write access since the last call
+ * can be missing the TLB_NOT_OURS flag, there is no need to scan the
+ * whole TLB.
+ */
 void S2EExecutionStateTlb::clearTlbOwnership() {
     CPUX86State *env = m_registers->getCpuState();
 
-    for (unsigned i = 0; i < CPU_TLB_SIZE; i++) {
-        for (unsigned mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i].addr_write |= TLB_NOT_OURS;
-        }
+    for (auto slot : m_ownedSlots) {
+        env->tlb_table[slot / CPU_TLB_SIZE][slot % CPU_TLB_SIZE].addr_write |= TLB_NOT_OURS;
     }
+
+    m_ownedSlots.clear();
+    ++m_ownershipGeneration;
 }
 
 void S2EExecutionStateTlb::updateTlbEntry(CPUX86State *env, int mmu_idx, uint64_t virtAddr, uint64_t hostAddr) {
@@ -253,15 +511,14 @@ void S2EExecutionStateTlb::updateTlbEntry(CPUX86State *env, int mmu_idx, uint64_
     if (oldObjectState != newObjectState) {
         flushTlbCachePage(oldObjectState, mmu_idx, index);
         if (!g_s2e_single_path_mode) {
-            m_tlbMap[newObjectState].push_back(TlbCoordinates(mmu_idx, index));
+            linkSlot(newObjectState, getSlotIndex(mmu_idx, index));
         }
     }
 
 #ifdef S2E_DEBUG_TLBCACHE
-    const ObjectStateTlbReferences &refs = m_tlbMap[const_cast<ObjectState *>(newObjectState)];
-    for (unsigned i = 0; i < refs.size(); ++i) {
+    for (unsigned slot = m_tlbMap[newObjectState]; slot != NO_SLOT; slot = m_slots[slot].next) {
         g_s2e->getDebugStream(g_s2e_state) << "   "
-                                           << " (" << refs[i].first << ',' << refs[i].second << ")\n";
+                                           << " (" << slot / CPU_TLB_SIZE << ',' << slot % CPU_TLB_SIZE << ")\n";
     }
 #endif
 
@@ -274,7 +531,7 @@ void S2EExecutionStateTlb::updateTlbEntry(CPUX86State *env, int mmu_idx, uint64_
         entry->se_addend = ((uintptr_t) newObjectState->getConcreteBuffer(true) - virtAddr);
 
         if (m_asCache->isOwnedByUs(newObjectState)) {
-            entry->addr_write &= ~TLB_NOT_OURS;
+            setOwned(env, mmu_idx, index);
         } else {
             entry->addr_write |= TLB_NOT_OURS;
         }
@@ -282,6 +539,10 @@ void S2EExecutionStateTlb::updateTlbEntry(CPUX86State *env, int mmu_idx, uint64_
 
     updateTlbEntryConcreteStatus(env, mmu_idx, index, newObjectState);
 
+    if (m_tracking) {
+        track(getSlotIndex(mmu_idx, index));
+    }
+
 #ifdef S2E_DEBUG_TLBCACHE
     audit();
 #endif
@@ -294,20 +555,22 @@ bool S2EExecutionStateTlb::audit() {
      */
     CPUX86State *env = m_registers->getCpuState();
 
+    unsigned linkedCount = 0;
     for (auto tlbIt : m_tlbMap) {
         auto os = tlbIt.first;
-        const ObjectStateTlbReferences &vec = tlbIt.second;
-        foreach2 (vit, vec.begin(), vec.end()) {
-            unsigned mmu_idx = (*vit).first;
-            unsigned index = (*vit).second;
-
-            CPUTLBEntry *entry = &env->tlb_table[mmu_idx][index];
+        unsigned prev = NO_SLOT;
+        for (unsigned slot = tlbIt.second; slot != NO_SLOT; slot = m_slots[slot].next) {
+            assert(m_slots[slot].prev == prev);
+            CPUTLBEntry *entry = &env->tlb_table[slot / CPU_TLB_SIZE][slot % CPU_TLB_SIZE];
             assert(entry->objectState == os);
             (void) entry;
-            (void) os;
+            prev = slot;
+            ++linkedCount;
         }
+        (void) os;
     }
 
+    unsigned usedCount = 0;
     for (unsigned i = 0; i < CPU_TLB_SIZE; i++) {
         for (unsigned mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
             CPUTLBEntry *entry = &env->tlb_table[mmu_idx][i];
@@ -315,20 +578,16 @@ bool S2EExecutionStateTlb::audit() {
                 continue;
             }
 
-            TlbMap::const_iterator it = m_tlbMap.find((ObjectState *) entry->objectState);
-            assert(it != m_tlbMap.end());
-
-            const ObjectStateTlbReferences &vec = (*it).second;
-            unsigned foundCount = 0;
-            foreach2 (vit, vec.begin(), vec.end()) {
-                if ((*vit).first == mmu_idx && (*vit).second == i) {
-                    foundCount++;
-                }
-            }
-            assert(foundCount == 1);
+            assert(m_tlbMap.find((ObjectState *) entry->objectState) != m_tlbMap.end());
+            ++usedCount;
         }
     }
 
+    // Every used entry is in the chain of its object, and only there
+    assert(linkedCount == usedCount);
+    (void) linkedCount;
+    (void) usedCount;
+
     return true;
 }
 }
@@ -62,8 +62,11 @@
 #include <windows.h>
 #else
 #include <sys/mman.h>
+#include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <climits>
 #include <functional>
 
 //#define S2E_DEBUG_INSTRUCTIONS
@@ -167,6 +170,81 @@ namespace {
     SinglePathMode("single-path-mode",
             cl::desc("Faster TLB, but forces single path execution"),
             cl::init(false));
+
+    cl::opt<bool>
+    CoalesceSplitPages("coalesce-split-pages",
+            cl::desc("Merge split RAM pages back into one object once all their bytes are concrete "
+                     "(pages that often become symbolic again get split over and over)"),
+            cl::init(false));
+
+    cl::opt<bool>
+    TargetedTlbFlush("targeted-tlb-flush",
+            cl::desc("Only invalidate the TLB entries that changed while finishing a TB in KLEE"),
+            cl::init(false));
+
+    cl::opt<bool>
+    LazyRam("lazy-ram",
+            cl::desc("Create the objects of guest RAM pages that only contain zeros on first access"),
+            cl::init(false));
+
+    cl::opt<bool>
+    ValidateTlbOnStateSwitch("validate-tlb-on-state-switch",
+            cl::desc("Check the saved TLB of a resumed state against its current memory objects"),
+            cl::init(false));
+
+    cl::opt<bool>
+    CompressIdleStates("compress-idle-states",
+            cl::desc("Compress the private RAM pages of states that have not run for a while"),
+            cl::init(false));
+
+    cl::opt<unsigned>
+    CompressIdleTime("compress-idle-time",
+            cl::desc("Number of seconds after which an inactive state gets compressed"),
+            cl::init(60));
+
+    cl::opt<unsigned>
+    CompressPagesPerScan("compress-pages-per-scan",
+            cl::desc("Number of RAM pages of idle states that each compression scan visits"),
+            cl::init(4096));
+
+    cl::opt<unsigned>
+    StateSwapWatermark("state-swap-watermark",
+            cl::desc("Write suspended states to disk when the memory usage "
+                     "exceeds this many MB (0 to disable)"),
+            cl::init(0));
+
+    cl::opt<unsigned>
+    MemorySoftLimit("memory-soft-limit",
+            cl::desc("Memory usage (PSS) in MB above which load balancing stops (0 to disable)"),
+            cl::init(0));
+
+    cl::opt<unsigned>
+    MemoryHardLimit("memory-hard-limit",
+            cl::desc("Memory usage (PSS) in MB above which states stop forking and "
+                     "idle states get swapped out (0 to disable)"),
+            cl::init(0));
+
+    cl::opt<unsigned>
+    MemoryPressureSwapCount("memory-pressure-swap-count",
+            cl::desc("Number of idle states to swap out per second while over the hard memory limit, "
+                     "and to resume per second once below the soft limit"),
+            cl::init(16));
+
+    cl::opt<unsigned>
+    MemoryAccountingInterval("memory-accounting-interval",
+            cl::desc("Number of seconds between two memory usage reports in run.stats (0 to disable)"),
+            cl::init(0));
+
+    cl::opt<bool>
+    LazyStateReclamation("lazy-state-reclamation",
+            cl::desc("Do not free the states dropped by load balancing right after the process fork"),
+            cl::init(false));
+
+    cl::opt<unsigned>
+    ReclaimedStatesPerTick("reclaimed-states-per-tick",
+            cl::desc("Number of dropped states to free every 100 ms with -lazy-state-reclamation "
+                     "(0 to leave them shared with the other process)"),
+            cl::init(1));
 }
 
 //The logs may be flooded with messages when switching execution mode.
@@ -237,10 +315,13 @@ volatile void *tb_function_args[3];
 
 S2EExecutor::S2EExecutor(S2E *s2e, TCGLLVMTranslator *translator, InterpreterHandler *ie)
     : Executor(ie, translator->getContext()), m_s2e(s2e), m_llvmTranslator(translator), m_executeAlwaysKlee(false),
-      m_forkProcTerminateCurrentState(false), m_inLoadBalancing(false) {
+      m_forkProcTerminateCurrentState(false), m_inLoadBalancing(false), m_memorySampleTicks(0),
+      m_lastMemoryAccountingTime(0) {
     delete externalDispatcher;
     externalDispatcher = new S2EExternalDispatcher();
 
+    m_memoryGovernor.setLimits((uint64_t) MemorySoftLimit * 1024 * 1024, (uint64_t) MemoryHardLimit * 1024 * 1024);
+
     LLVMContext &ctx = m_llvmTranslator->getContext();
 
 /* Define globally accessible functions */
@@ -546,6 +627,20 @@ void S2EExecutor::registerSharedExternalObject(S2EExecutionState *state, void *a
     addExternalObject(*state, address, size, false, true);
 }
 
+/// Check whether a guest RAM object only contains zeros. The data is always
+/// read: pages that are not resident may still hold guest data (swapped out,
+/// file-backed or restored from a snapshot).
+static bool isZeroRamObject(uint64_t address) {
+    const uint64_t *data = (const uint64_t *) address;
+    for (unsigned i = 0; i < SE_RAM_OBJECT_SIZE / sizeof(*data); ++i) {
+        if (data[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void S2EExecutor::registerRam(S2EExecutionState *initialState, MemoryDesc *region, uint64_t startAddress, uint64_t size,
                               uint64_t hostAddress, bool isSharedConcrete, bool saveOnContextSwitch, const char *name) {
 #ifdef CONFIG_SYMBEX_MP
@@ -559,7 +654,16 @@ void S2EExecutor::registerRam(S2EExecutionState *initialState, MemoryDesc *regio
                             << ", size = " << hexval(size) << ", hostAddr = " << hexval(hostAddress)
                             << ", isSharedConcrete=" << isSharedConcrete << ", name=" << name << ")\n";
 
+    llvm::sys::TimeValue startTime = llvm::sys::TimeValue::now();
+    bool lazy = LazyRam && !isSharedConcrete;
+    uint64_t lazyObjects = 0;
+
     for (uint64_t addr = hostAddress; addr < hostAddress + size; addr += SE_RAM_OBJECT_SIZE) {
+        // Pages without data get their object when they are first accessed
+        if (lazy && isZeroRamObject(addr)) {
+            ++lazyObjects;
+            continue;
+        }
 
         auto os = addExternalObject(*initialState, (void *) addr, SE_RAM_OBJECT_SIZE, false, isSharedConcrete);
 
@@ -602,6 +706,16 @@ void S2EExecutor::registerRam(S2EExecutionState *initialState, MemoryDesc *regio
     }
 
     initialState->m_asCache.registerPool(hostAddress, size);
+
+    if (lazy) {
+        AddressSpaceCache::registerLazyRegion(hostAddress, size);
+        AddressSpaceCache::addLazyPages(lazyObjects);
+    }
+
+    llvm::sys::TimeValue elapsed = llvm::sys::TimeValue::now() - startTime;
+    m_s2e->getDebugStream() << "Registered " << (size / SE_RAM_OBJECT_SIZE - lazyObjects) << " RAM objects ("
+                            << lazyObjects << " deferred) in " << elapsed.msec() << " ms, memory usage "
+                            << S2EStatsTracker::getProcessMemoryUsage() << " bytes\n";
 #endif
 }
 
@@ -609,7 +723,8 @@ void S2EExecutor::registerDirtyMask(S2EExecutionState *state, uint64_t hostAddre
     // Assume that dirty mask is small enough, so no need to split it in small pages
     auto dirtyMask = g_s2e->getExecutor()->addExternalObject(*state, (void *) hostAddress, size, false, true);
 
-    state->m_memory.initialize(&state->addressSpace, &state->m_asCache, &state->m_active, state, state, dirtyMask);
+    state->m_memory.initialize(&state->addressSpace, &state->m_asCache, &state->m_active, state, state, state,
+                              dirtyMask);
 
     klee::ExecutionState::s_ignoredMergeObjects.insert(state->m_memory.getDirtyMask());
 
@@ -658,6 +773,10 @@ void S2EExecutor::doLoadBalancing() {
         return;
     }
 
+    if (!m_memoryGovernor.allowProcessSplit()) {
+        return;
+    }
+
     std::vector<S2EExecutionState *> allStates;
 
     foreach2 (it, states.begin(), states.end()) {
@@ -693,6 +812,11 @@ void S2EExecutor::doLoadBalancing() {
     std::unordered_map<ExecutionState *, uint64_t> newIds;
     computeNewStateGuids(newIds, parentSet, childSet);
 
+    // Both processes keep the suspended states, so they cannot share swap files
+    for (auto state : m_suspendedStates) {
+        state->loadSpilledRam();
+    }
+
     m_inLoadBalancing = true;
 
     unsigned parentId = m_s2e->getCurrentInstanceId();
@@ -712,6 +836,7 @@ void S2EExecutor::doLoadBalancing() {
     /// Go through all the states and kill those that are
     /// not in the sets.
     StateSet &currentSet = child ? childSet : parentSet;
+    size_t deletedStates = m_deletedStates.size();
 
     for (auto state : allStates) {
         S2EExecutionState *s2estate = static_cast<S2EExecutionState *>(state);
@@ -723,6 +848,15 @@ void S2EExecutor::doLoadBalancing() {
         }
     }
 
+    if (LazyStateReclamation) {
+        // Freeing the dropped states writes to all their objects, which are
+        // still shared with the other process and would have to be copied.
+        m_abandonedStates.insert(m_abandonedStates.end(), m_deletedStates.begin() + deletedStates,
+                                 m_deletedStates.end());
+        stats::abandonedStates += m_deletedStates.size() - deletedStates;
+        m_deletedStates.resize(deletedStates);
+    }
+
     // We have to re-assign globally unique IDs to states that
     // have been kept in both child and parent sets. This is required
     // to avoid confusing execution tracers.
@@ -742,12 +876,281 @@ void S2EExecutor::doLoadBalancing() {
     m_inLoadBalancing = false;
 }
 
+void S2EExecutor::reclaimAbandonedStates() {
+    unsigned count = 0;
+    for (auto it = m_abandonedStates.begin(); it != m_abandonedStates.end() && count < ReclaimedStatesPerTick;) {
+        S2EExecutionState *state = *it;
+
+        // The current state is freed once the executor switches away from it
+        if (state->isActive()) {
+            ++it;
+            continue;
+        }
+
+        delete state;
+        it = m_abandonedStates.erase(it);
+        ++stats::reclaimedStates;
+        ++count;
+    }
+}
+
+void S2EExecutor::compressIdleStates() {
+    unsigned budget = CompressPagesPerScan;
+
+    for (auto es : states) {
+        if (!budget) {
+            break;
+        }
+
+        S2EExecutionState *state = static_cast<S2EExecutionState *>(es);
+        if (state->isActive() || state->m_ramCompressed || state->isMachineStateSpilled() ||
+            state->getIdleTime() < CompressIdleTime) {
+            continue;
+        }
+
+        unsigned count = state->compressRam(m_unusedMemoryDescs, budget);
+        if (count) {
+            m_s2e->getDebugStream(state) << "Compressed " << count << " RAM pages of idle state\n";
+        }
+    }
+}
+
+bool S2EExecutor::spillState(S2EExecutionState *state) {
+    assert(!state->isActive());
+
+    std::stringstream ss;
+    ss << "state-" << state->getID();
+
+    if (!state->isRamSpilled()) {
+        if (!state->m_ramCompressed) {
+            // Finish the pass in one go
+            unsigned budget = UINT_MAX;
+            state->compressRam(m_unusedMemoryDescs, budget);
+        }
+
+        if (!state->spillRam(m_s2e->getOutputFilename(ss.str() + ".swap"))) {
+            m_s2e->getWarningsStream(state) << "Could not write the RAM of the state to disk\n";
+            return false;
+        }
+    }
+
+    if (!state->isMachineStateSpilled() && !state->spillMachineState(m_s2e->getOutputFilename(ss.str() + ".state"))) {
+        m_s2e->getWarningsStream(state) << "Could not write the registers and device state to disk\n";
+        return false;
+    }
+
+    return true;
+}
+
+void S2EExecutor::swapOutStates() {
+    if (S2EStatsTracker::getProcessResidentMemoryUsage() < (uint64_t) StateSwapWatermark * 1024 * 1024) {
+        return;
+    }
+
+    for (auto state : m_suspendedStates) {
+        if (!state->isActive() && !spillState(state)) {
+            return;
+        }
+    }
+}
+
+void S2EExecutor::swapOutIdleStates() {
+    std::vector<S2EExecutionState *> candidates;
+    for (auto es : states) {
+        S2EExecutionState *state = static_cast<S2EExecutionState *>(es);
+        if (!state->isActive() && !state->isZombie() && !state->isPinned()) {
+            candidates.push_back(state);
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](S2EExecutionState *a, S2EExecutionState *b) {
+        return a->getIdleTime() > b->getIdleTime();
+    });
+
+    // Keep the most recently active state runnable, the current one may terminate
+    if (!candidates.empty()) {
+        candidates.pop_back();
+    }
+
+    if (candidates.size() > MemoryPressureSwapCount) {
+        candidates.resize(MemoryPressureSwapCount);
+    }
+
+    for (auto state : candidates) {
+        if (!suspendState(state)) {
+            return;
+        }
+
+        m_governorSuspendedStates.insert(state);
+        ++stats::memoryPressureSuspendedStates;
+        m_s2e->getCorePlugin()->onMemoryPressureStateSuspend.emit(state, true);
+
+        if (!spillState(state)) {
+            return;
+        }
+    }
+}
+
+void S2EExecutor::resumeGovernorSuspendedStates(unsigned count) {
+    std::vector<S2EExecutionState *> candidates(m_governorSuspendedStates.begin(), m_governorSuspendedStates.end());
+
+    // Resume the states that ran most recently first
+    std::sort(candidates.begin(), candidates.end(), [](S2EExecutionState *a, S2EExecutionState *b) {
+        return a->getIdleTime() < b->getIdleTime();
+    });
+
+    if (candidates.size() > count) {
+        candidates.resize(count);
+    }
+
+    for (auto state : candidates) {
+        // resumeState removes the state from the set
+        resumeState(state);
+        m_s2e->getCorePlugin()->onMemoryPressureStateSuspend.emit(state, false);
+    }
+}
+
+void S2EExecutor::updateMemoryPressure() {
+    // After load balancing, the RSS counts pages shared with the other process twice
+    uint64_t rss, usage;
+    if (!S2EStatsTracker::getProcessSmapsRollup(rss, usage)) {
+        usage = S2EStatsTracker::getProcessResidentMemoryUsage();
+    }
+
+    if (m_memoryGovernor.update(usage)) {
+        MemoryPressureLevel level = m_memoryGovernor.getLevel();
+        m_s2e->getWarningsStream() << "Memory usage is " << usage / (1024 * 1024)
+                                   << " MB, memory pressure level is now " << level << '\n';
+        m_s2e->getCorePlugin()->onMemoryPressure.emit(level, usage);
+    }
+
+    if (m_memoryGovernor.shouldSwapStates()) {
+        swapOutIdleStates();
+    } else if (m_memoryGovernor.getLevel() == MEMORY_PRESSURE_NONE && !m_governorSuspendedStates.empty()) {
+        // Resuming a state reloads its RAM, do it gradually so that
+        // the usage does not go right back over the limits
+        resumeGovernorSuspendedStates(MemoryPressureSwapCount);
+    }
+}
+
+void S2EExecutor::getStateMemoryUsage(S2EExecutionState *state, StateMemoryUsage &usage,
+                                      std::unordered_set<const ObjectState *> &ramObjects, uint64_t &ramObjectBytes) {
+    for (auto &region : m_unusedMemoryDescs) {
+        uint64_t end = region.first + region.second;
+        for (uint64_t address = region.first; address < end;) {
+            auto os = state->addressSpace.findObject(address);
+            if (!os) {
+                // Zero-backed or compressed page
+                address += SE_RAM_OBJECT_SIZE;
+                continue;
+            }
+
+            if (state->addressSpace.isOwnedByUs(os)) {
+                usage.privateRamBytes += os->getSize();
+            } else {
+                usage.sharedRamBytes += os->getSize();
+            }
+
+            if (ramObjects.insert(os.get()).second) {
+                ramObjectBytes += os->getSize();
+            }
+
+            // Split pages have one object per subpage
+            address += os->getSize();
+        }
+    }
+
+    usage.compressedRamBytes = state->m_asCache.getCompressedBytes();
+    usage.deviceStateBytes = state->getDeviceState()->getStateBufferSize();
+    usage.diskSectorBytes = state->getDeviceState()->getSectorBytes();
+
+    for (auto &it : state->m_PluginState) {
+        usage.pluginStateBytes += it.second->getMemoryUsage();
+    }
+}
+
+StateMemoryUsage S2EExecutor::getStateMemoryUsage(S2EExecutionState *state) {
+    StateMemoryUsage usage;
+    std::unordered_set<const ObjectState *> ramObjects;
+    uint64_t ramObjectBytes = 0;
+
+    getStateMemoryUsage(state, usage, ramObjects, ramObjectBytes);
+    return usage;
+}
+
+MemoryUsageReport S2EExecutor::getMemoryUsageReport() {
+    MemoryUsageReport report;
+
+    if (!S2EStatsTracker::getProcessSmapsRollup(report.residentBytes, report.proportionalBytes)) {
+        report.residentBytes = S2EStatsTracker::getProcessResidentMemoryUsage();
+    }
+
+    std::vector<S2EExecutionState *> allStates;
+    for (auto es : states) {
+        allStates.push_back(static_cast<S2EExecutionState *>(es));
+    }
+    allStates.insert(allStates.end(), m_suspendedStates.begin(), m_suspendedStates.end());
+
+    std::unordered_set<const ObjectState *> ramObjects;
+    for (auto state : allStates) {
+        StateMemoryUsage usage;
+        getStateMemoryUsage(state, usage, ramObjects, report.ramObjectBytes);
+
+        report.compressedRamBytes += usage.compressedRamBytes;
+        report.deviceStateBytes += usage.deviceStateBytes;
+        report.diskSectorBytes += usage.diskSectorBytes;
+        report.pluginStateBytes += usage.pluginStateBytes;
+
+        if (state == g_s2e_state) {
+            report.currentState = usage;
+        }
+    }
+
+    for (auto &tb : m_s2eTbs) {
+        if (!tb->translationBlock) {
+            continue;
+        }
+
+        ++report.llvmTranslationBlocks;
+        for (auto &bb : *tb->translationBlock) {
+            report.llvmInstructions += bb.size();
+        }
+    }
+
+    return report;
+}
+
 void S2EExecutor::stateSwitchTimerCallback(void *opaque) {
     S2EExecutor *c = (S2EExecutor *) opaque;
 
     assert(env->current_tb == nullptr);
 
     if (g_s2e_state) {
+        if (CompressIdleStates) {
+            c->compressIdleStates();
+        }
+
+        if (StateSwapWatermark) {
+            c->swapOutStates();
+        }
+
+        if (ReclaimedStatesPerTick && !c->m_abandonedStates.empty()) {
+            c->reclaimAbandonedStates();
+        }
+
+        // Sample the memory usage once per second
+        if (c->m_memoryGovernor.isEnabled() && ++c->m_memorySampleTicks % 10 == 0) {
+            c->updateMemoryPressure();
+        }
+
+        if (MemoryAccountingInterval) {
+            uint64_t now = llvm::sys::TimeValue::now().seconds();
+            if (now - c->m_lastMemoryAccountingTime >= MemoryAccountingInterval) {
+                c->m_lastMemoryUsageReport = c->getMemoryUsageReport();
+                c->m_lastMemoryAccountingTime = now;
+            }
+        }
+
         c->doLoadBalancing();
         S2EExecutionState *nextState = c->selectNextState(g_s2e_state);
         if (nextState) {
@@ -819,6 +1222,7 @@ void S2EExecutor::doStateSwitch(S2EExecutionState *oldState, S2EExecutionState *
 
         oldState->m_registers.saveConcreteState();
         oldState->m_active = false;
+        oldState->m_lastActiveTime = llvm::sys::TimeValue::now().seconds();
     }
 
     if (newState) {
@@ -826,6 +1230,8 @@ void S2EExecutor::doStateSwitch(S2EExecutionState *oldState, S2EExecutionState *
             m_s2e->getDebugStream(newState) << "Restoring state\n";
         }
 
+        newState->decompressRam();
+
         timers_state = *newState->m_timersState;
         if (g_sqi.exec.clock_scaling_factor) {
             *g_sqi.exec.clock_scaling_factor = timers_state.cpu_clock_scale_factor;
@@ -857,6 +1263,11 @@ void S2EExecutor::doStateSwitch(S2EExecutionState *oldState, S2EExecutionState *
             totalCopied += mo.size;
             objectsCopied++;
         }
+
+        // The TLB was restored along with the rest of the CPU state
+        if (ValidateTlbOnStateSwitch) {
+            stats::staleTlbEntries += newState->m_tlb.dropStaleEntries();
+        }
     }
 
     cpu_enable_ticks();
@@ -879,6 +1290,11 @@ void S2EExecutor::doStateSwitch(S2EExecutionState *oldState, S2EExecutionState *
 ExecutionState *S2EExecutor::selectSearcherState(S2EExecutionState *state) {
     ExecutionState *newState = nullptr;
 
+    if (searcher->empty() && !m_governorSuspendedStates.empty()) {
+        // Do not end the run while the memory governor holds states back
+        resumeGovernorSuspendedStates(1);
+    }
+
     if (!searcher->empty()) {
         newState = &searcher->selectState();
     }
@@ -1076,6 +1492,10 @@ bool S2EExecutor::finalizeTranslationBlockExec(S2EExecutionState *state) {
         }
     }
 
+    target_ulong pageDir = env->cr[3];
+    uint32_t cpl = env->hflags & HF_CPL_MASK;
+    TlbTrackingScope tracking(TargetedTlbFlush ? state->getTlb() : nullptr);
+
     /**
      * TBs can fork anywhere and the remainder can also throw exceptions.
      * Should exit the CPU loop in this case.
@@ -1090,8 +1510,19 @@ bool S2EExecutor::finalizeTranslationBlockExec(S2EExecutionState *state) {
     /**
      * Memory topology may change on state switches.
      * Ensure that there are no bad mappings left.
+     * Entries that were not touched while finishing the TB are still valid,
+     * unless the address space or the privilege level changed.
      */
-    tlb_flush(env, 1);
+    bool fullFlush = !TargetedTlbFlush || g_s2e_state != state || env->cr[3] != pageDir ||
+                     (env->hflags & HF_CPL_MASK) != cpl;
+
+    if (fullFlush) {
+        tlb_flush(env, 1);
+    } else {
+        state->getTlb()->flushTrackedEntries(env);
+        state->mem()->flushHostAddressCache();
+        ++stats::tlbFlushesAvoided;
+    }
 
     return ret;
 }
@@ -1219,6 +1650,12 @@ uintptr_t S2EExecutor::executeTranslationBlock(S2EExecutionState *state, Transla
     static unsigned doStatsIncrementCount = 0;
     assert(state->isActive());
 
+    // Merging split pages replaces objects referenced by the TLB,
+    // so only do it between translation blocks.
+    if (CoalesceSplitPages && state->hasCoalescingCandidates()) {
+        state->coalesceSplitPages();
+    }
+
     updateConcreteFastPath(state);
 
     bool executeKlee = m_executeAlwaysKlee;
@@ -1295,6 +1732,9 @@ uintptr_t S2EExecutor::executeTranslationBlock(S2EExecutionState *state, Transla
 void S2EExecutor::cleanupTranslationBlock(S2EExecutionState *state) {
     assert(state->m_active);
 
+    // finalizeTranslationBlockExec may have been left through a longjmp
+    state->getTlb()->endTracking();
+
     if (state->m_forkAborted) {
         return;
     }
@@ -1348,6 +1788,8 @@ klee::ref<klee::Expr> S2EExecutor::executeFunction(S2EExecutionState *state, con
 
 void S2EExecutor::deleteState(klee::ExecutionState *state) {
     assert(dynamic_cast<S2EExecutionState *>(state));
+    m_suspendedStates.erase(static_cast<S2EExecutionState *>(state));
+    m_governorSuspendedStates.erase(static_cast<S2EExecutionState *>(state));
     m_deletedStates.push_back(static_cast<S2EExecutionState *>(state));
 }
 
@@ -1422,6 +1864,12 @@ S2EExecutor::StatePair S2EExecutor::fork(ExecutionState &current, const klee::re
         if (!forkOk) {
             g_s2e->getDebugStream(currentState) << "fork prevented by request from plugin\n";
         }
+
+        if (forkOk && !m_memoryGovernor.allowStateFork()) {
+            g_s2e->getDebugStream(currentState) << "fork prevented by memory pressure\n";
+            ++stats::memoryPressureDeferredForks;
+            forkOk = false;
+        }
     }
 
     bool oldForkStatus = currentState->forkDisabled;
@@ -1429,10 +1877,23 @@ S2EExecutor::StatePair S2EExecutor::fork(ExecutionState &current, const klee::re
         currentState->forkDisabled = true;
     }
 
+    // The branch that does not hold under the current concolic assignment gets a new one
+    klee::ref<klee::ConstantExpr> concolicCondition =
+        dyn_cast<klee::ConstantExpr>(currentState->concolics->evaluate(condition));
+
     res = Executor::fork(current, condition, keepConditionTrueInCurrentState);
 
     currentState->forkDisabled = oldForkStatus;
 
+    // KLEE updates the assignment through klee::ExecutionState, the other state
+    // keeps sharing the concretization cache with the parent.
+    if (res.first && (concolicCondition.isNull() || concolicCondition->isFalse())) {
+        static_cast<S2EExecutionState *>(res.first)->bumpConcolicsVersion();
+    }
+    if (res.second && (concolicCondition.isNull() || concolicCondition->isTrue())) {
+        static_cast<S2EExecutionState *>(res.second)->bumpConcolicsVersion();
+    }
+
     if (!(res.first && res.second)) {
         return res;
     }
@@ -1602,6 +2063,10 @@ bool S2EExecutor::merge(klee::ExecutionState &_base, klee::ExecutionState &_othe
     S2EExecutionState &base = static_cast<S2EExecutionState &>(_base);
     S2EExecutionState &other = static_cast<S2EExecutionState &>(_other);
 
+    /* Merging compares the memory objects of both states */
+    base.decompressRam();
+    other.decompressRam();
+
     /* Ensure that both states are inactive, otherwise merging will not work */
     bool s1 = false, s2 = false;
     if (base.m_active) {
@@ -1767,6 +2232,7 @@ bool S2EExecutor::suspendState(S2EExecutionState *state) {
         searcher->removeState(state, nullptr);
         size_t r = states.erase(state);
         assert(r == 1);
+        m_suspendedStates.insert(state);
         return true;
     }
     return false;
@@ -1777,6 +2243,9 @@ bool S2EExecutor::resumeState(S2EExecutionState *state) {
         if (states.find(state) != states.end()) {
             return false;
         }
+        m_suspendedStates.erase(state);
+        m_governorSuspendedStates.erase(state);
+        state->decompressRam();
         states.insert(state);
         searcher->addState(state, nullptr);
         return true;
@@ -1905,10 +2374,17 @@ void s2e_increment_tb_stats(void *se_tb) {
 
 void s2e_flush_tlb_cache() {
     g_s2e_state->getTlb()->flushTlbCache();
+    g_s2e_state->mem()->flushHostAddressCache();
 }
 
 void se_flush_tlb_cache_page(void *objectState, int mmu_idx, int index) {
     g_s2e_state->getTlb()->flushTlbCachePage(static_cast<klee::ObjectState *>(objectState), mmu_idx, index);
+    g_s2e_state->mem()->flushHostAddressCachePage(index);
+}
+
+void se_flush_tlb_page(uint64_t vaddr) {
+    // Plugins may have translated pages that were never loaded in the CPU TLB
+    g_s2e_state->mem()->flushHostAddressCachePage((vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1));
 }
 
 /** Tlb cache helpers */
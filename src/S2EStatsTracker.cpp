@@ -8,6 +8,7 @@
 
 #include <s2e/S2EStatsTracker.h>
 
+#include <s2e/S2E.h>
 #include <s2e/S2EExecutionState.h>
 #include <s2e/S2EExecutor.h>
 
@@ -57,6 +58,40 @@ Statistic totalBasicBlocks("TotalBasicBlocks", "TotalBasicBlocks");
 Statistic coveredBasicBlocks("CoveredBasicBlocks", "CoveredBasicBlocks");
 
 Statistic bugs("Bugs", "Bugs");
+
+Statistic concretizationCacheHits("ConcretizationCacheHits", "ConcrCacheHits");
+Statistic concretizationCacheMisses("ConcretizationCacheMisses", "ConcrCacheMisses");
+
+Statistic hostAddressCacheHits("HostAddressCacheHits", "HostAddrCacheHits");
+Statistic hostAddressCacheMisses("HostAddressCacheMisses", "HostAddrCacheMisses");
+
+Statistic splitRamObjects("SplitRamObjects", "SplitRamObjects");
+Statistic coalescedRamObjects("CoalescedRamObjects", "CoalescedRamObjects");
+
+Statistic tlbFlushesAvoided("TlbFlushesAvoided", "TlbFlushesAvoided");
+Statistic staleTlbEntries("StaleTlbEntries", "StaleTlbEntries");
+
+Statistic ramTlbMisses("RamTlbMisses", "RamTlbMisses");
+Statistic ramTlbConflicts("RamTlbConflicts", "RamTlbConflicts");
+Statistic ramTlbVictimHits("RamTlbVictimHits", "RamTlbVictimHits");
+
+Statistic materializedRamObjects("MaterializedRamObjects", "MaterializedRamObjects");
+
+Statistic compressedRamPages("CompressedRamPages", "CompressedRamPages");
+Statistic ramCompressionInputBytes("RamCompressionInputBytes", "RamCompressionInputBytes");
+Statistic ramCompressionOutputBytes("RamCompressionOutputBytes", "RamCompressionOutputBytes");
+Statistic decompressedRamPages("DecompressedRamPages", "DecompressedRamPages");
+Statistic ramDecompressionTime("RamDecompressionTime", "RamDecompressionTime");
+
+Statistic spilledRamPages("SpilledRamPages", "SpilledRamPages");
+Statistic spilledRamBytes("SpilledRamBytes", "SpilledRamBytes");
+Statistic ramSwapInTime("RamSwapInTime", "RamSwapInTime");
+
+Statistic memoryPressureDeferredForks("MemoryPressureDeferredForks", "MemoryPressureDeferredForks");
+Statistic memoryPressureSuspendedStates("MemoryPressureSuspendedStates", "MemoryPressureSuspendedStates");
+
+Statistic abandonedStates("AbandonedStates", "AbandonedStates");
+Statistic reclaimedStates("ReclaimedStates", "ReclaimedStates");
 } // namespace stats
 } // namespace klee
 
@@ -69,6 +104,33 @@ cl::opt<bool> CsvOutput("output-csv-stats", cl::desc("Output run.stats in CSV fo
 
 namespace s2e {
 
+#if !defined(CONFIG_WIN32) && !defined(CONFIG_DARWIN)
+/// Return the size in bytes of the given /proc/<pid>/status field
+static uint64_t readProcessStatus(const char *format) {
+    pid_t myPid = getpid();
+    std::stringstream ss;
+    ss << "/proc/" << myPid << "/status";
+
+    FILE *fp = fopen(ss.str().c_str(), "r");
+    if (!fp) {
+        return 0;
+    }
+
+    uint64_t value = 0;
+
+    char buffer[512];
+    while (!value && fgets(buffer, sizeof(buffer), fp)) {
+        if (sscanf(buffer, format, &value)) {
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return value * 1024;
+}
+#endif
+
 /**
  *  Replaces the broken LLVM functions
  */
@@ -96,27 +158,51 @@ uint64_t S2EStatsTracker::getProcessMemoryUsage() {
     return t_info.resident_size;
 
 #else
-    pid_t myPid = getpid();
-    std::stringstream ss;
-    ss << "/proc/" << myPid << "/status";
+    return readProcessStatus("VmSize: %" PRIu64);
+#endif
+}
 
-    FILE *fp = fopen(ss.str().c_str(), "r");
-    if (!fp) {
+uint64_t S2EStatsTracker::getProcessResidentMemoryUsage() {
+#if defined(CONFIG_WIN32)
+    PROCESS_MEMORY_COUNTERS Memory;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &Memory, sizeof(Memory))) {
         return 0;
     }
 
-    uint64_t peakMem = 0;
+    return Memory.WorkingSetSize;
+
+#elif defined(CONFIG_DARWIN)
+    return getProcessMemoryUsage();
+
+#else
+    return readProcessStatus("VmRSS: %" PRIu64);
+#endif
+}
+
+bool S2EStatsTracker::getProcessSmapsRollup(uint64_t &rss, uint64_t &pss) {
+#if defined(CONFIG_WIN32) || defined(CONFIG_DARWIN)
+    return false;
+#else
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) {
+        return false;
+    }
+
+    rss = 0;
+    pss = 0;
 
     char buffer[512];
-    while (!peakMem && fgets(buffer, sizeof(buffer), fp)) {
-        if (sscanf(buffer, "VmSize: %" PRIu64, &peakMem)) {
-            break;
+    while (fgets(buffer, sizeof(buffer), fp)) {
+        uint64_t value;
+        if (sscanf(buffer, "Rss: %" PRIu64, &value) == 1) {
+            rss = value * 1024;
+        } else if (sscanf(buffer, "Pss: %" PRIu64, &value) == 1) {
+            pss = value * 1024;
         }
     }
 
     fclose(fp);
-
-    return peakMem * 1024;
+    return true;
 #endif
 }
 
@@ -149,7 +235,45 @@ void S2EStatsTracker::writeStatsHeader() {
         "CexCacheTime",
         "ForkTime",
         "ResolveTime",
-        "MemoryUsage"
+        "MemoryUsage",
+        "ConcretizationCacheHits",
+        "ConcretizationCacheMisses",
+        "HostAddressCacheHits",
+        "HostAddressCacheMisses",
+        "SplitRamObjects",
+        "CoalescedRamObjects",
+        "LiveSplitRamObjects",
+        "TlbFlushesAvoided",
+        "StaleTlbEntries",
+        "RamTlbMisses",
+        "RamTlbConflicts",
+        "RamTlbVictimHits",
+        "MaterializedRamObjects",
+        "ZeroBackedRamPages",
+        "CompressedRamPages",
+        "RamCompressionInputBytes",
+        "RamCompressionOutputBytes",
+        "DecompressedRamPages",
+        "RamDecompressionTime",
+        "SpilledRamPages",
+        "SpilledRamBytes",
+        "RamSwapInTime",
+        "ResidentMemoryUsage",
+        "MemoryPressureLevel",
+        "MemoryPressureDeferredForks",
+        "MemoryPressureSuspendedStates",
+        "ProportionalMemoryUsage",
+        "RamObjectBytes",
+        "CompressedRamBytes",
+        "DeviceStateBytes",
+        "DiskSectorBytes",
+        "PluginStateBytes",
+        "LlvmTranslationBlocks",
+        "LlvmInstructions",
+        "StatePrivateRamBytes",
+        "StateSharedRamBytes",
+        "AbandonedStates",
+        "ReclaimedStates"
     };
     // clang-format on
 
@@ -175,6 +299,11 @@ void S2EStatsTracker::writeStatsHeader() {
 }
 
 void S2EStatsTracker::writeStatsLine() {
+    uint64_t rss = 0, pss = 0;
+    getProcessSmapsRollup(rss, pss);
+
+    const MemoryUsageReport &memoryUsage = g_s2e->getExecutor()->getLastMemoryUsageReport();
+
     if (!CsvOutput) {
         *statsFile << "(";
     }
@@ -207,7 +336,45 @@ void S2EStatsTracker::writeStatsLine() {
              << "," << stats::cexCacheTime / 1000000.
              << "," << stats::forkTime / 1000000.
              << "," << stats::resolveTime / 1000000.
-             << "," << getProcessMemoryUsage();
+             << "," << getProcessMemoryUsage()
+             << "," << stats::concretizationCacheHits
+             << "," << stats::concretizationCacheMisses
+             << "," << stats::hostAddressCacheHits
+             << "," << stats::hostAddressCacheMisses
+             << "," << stats::splitRamObjects
+             << "," << stats::coalescedRamObjects
+             << "," << S2EExecutionState::getLiveSplitPageCount()
+             << "," << stats::tlbFlushesAvoided
+             << "," << stats::staleTlbEntries
+             << "," << stats::ramTlbMisses
+             << "," << stats::ramTlbConflicts
+             << "," << stats::ramTlbVictimHits
+             << "," << stats::materializedRamObjects
+             << "," << (g_s2e_state ? g_s2e_state->getZeroBackedPageCount() : 0)
+             << "," << stats::compressedRamPages
+             << "," << stats::ramCompressionInputBytes
+             << "," << stats::ramCompressionOutputBytes
+             << "," << stats::decompressedRamPages
+             << "," << stats::ramDecompressionTime
+             << "," << stats::spilledRamPages
+             << "," << stats::spilledRamBytes
+             << "," << stats::ramSwapInTime
+             << "," << getProcessResidentMemoryUsage()
+             << "," << g_s2e->getExecutor()->getMemoryGovernor().getLevel()
+             << "," << stats::memoryPressureDeferredForks
+             << "," << stats::memoryPressureSuspendedStates
+             << "," << pss
+             << "," << memoryUsage.ramObjectBytes
+             << "," << memoryUsage.compressedRamBytes
+             << "," << memoryUsage.deviceStateBytes
+             << "," << memoryUsage.diskSectorBytes
+             << "," << memoryUsage.pluginStateBytes
+             << "," << memoryUsage.llvmTranslationBlocks
+             << "," << memoryUsage.llvmInstructions
+             << "," << memoryUsage.currentState.privateRamBytes
+             << "," << memoryUsage.currentState.sharedRamBytes
+             << "," << stats::abandonedStates
+             << "," << stats::reclaimedStates;
     // clang-format on
     if (!CsvOutput) {
         *statsFile << ")";